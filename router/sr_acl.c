@@ -0,0 +1,477 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_acl.c
+ *
+ * Description:
+ *
+ * Interface packet filters compiled for bit-vector classification, see
+ * sr_acl.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#define __USE_MISC 1 /* force linux to show inet_aton */
+#include <arpa/inet.h>
+
+#include "sr_acl.h"
+#include "sr_if.h"
+#include "sr_router.h"
+
+/* The fields a rule matches on */
+typedef enum {
+    sr_acl_src,
+    sr_acl_dst,
+    sr_acl_proto,
+    sr_acl_sport,
+    sr_acl_dport,
+    sr_acl_flags
+} sr_acl_field_id;
+
+static const char sr_acl_flag_names[] = "FSRPAUEC";
+
+/* Whether a rule accepts value v of a field */
+static int sr_acl_rule_has(const struct sr_acl_rule *rule,
+                           sr_acl_field_id id, uint32_t v)
+{
+    switch (id) {
+    case sr_acl_src:
+        return rule->src_lo <= v && v <= rule->src_hi;
+    case sr_acl_dst:
+        return rule->dst_lo <= v && v <= rule->dst_hi;
+    case sr_acl_proto:
+        return rule->proto_lo <= v && v <= rule->proto_hi;
+    case sr_acl_sport:
+        return rule->sport_lo <= v && v <= rule->sport_hi;
+    case sr_acl_dport:
+        return rule->dport_lo <= v && v <= rule->dport_hi;
+    case sr_acl_flags:
+        return (v & rule->flags_mask) == rule->flags;
+    }
+    return 0;
+}
+
+static int sr_acl_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Collect where the rules' ranges of a field begin and end, and give
+   each elementary interval between them its vector. The flags field is
+   not a range and gets one interval per value once any rule uses it. */
+static int sr_acl_compile_field(struct sr_acl *acl, struct sr_acl_field *field,
+                                sr_acl_field_id id)
+{
+    uint32_t *bounds = (uint32_t *) malloc((2 * acl->count + 256) * sizeof(uint32_t));
+    unsigned int n = 0, i, r;
+
+    if (bounds == NULL) {
+        return -1;
+    }
+    bounds[n++] = 0;
+    for (r = 0; r < acl->count; r++) {
+        const struct sr_acl_rule *rule = &acl->rules[r];
+        uint32_t lo = 0, hi = 0, max = 0xffff;
+        switch (id) {
+        case sr_acl_src:
+            lo = rule->src_lo; hi = rule->src_hi; max = 0xffffffff;
+            break;
+        case sr_acl_dst:
+            lo = rule->dst_lo; hi = rule->dst_hi; max = 0xffffffff;
+            break;
+        case sr_acl_proto:
+            lo = rule->proto_lo; hi = rule->proto_hi; max = 0xff;
+            break;
+        case sr_acl_sport:
+            lo = rule->sport_lo; hi = rule->sport_hi;
+            break;
+        case sr_acl_dport:
+            lo = rule->dport_lo; hi = rule->dport_hi;
+            break;
+        case sr_acl_flags:
+            if (rule->flags_mask && n == 1) {
+                for (i = 1; i < 256; i++) {
+                    bounds[n++] = i;
+                }
+            }
+            continue;
+        }
+        bounds[n++] = lo;
+        if (hi < max) {
+            bounds[n++] = hi + 1;
+        }
+    }
+
+    qsort(bounds, n, sizeof(uint32_t), sr_acl_cmp);
+    field->count = 0;
+    for (i = 0; i < n; i++) {
+        if (field->count == 0 || bounds[i] != bounds[field->count - 1]) {
+            bounds[field->count++] = bounds[i];
+        }
+    }
+    field->starts = bounds;
+    field->vectors = (uint32_t *) calloc(field->count * acl->words, sizeof(uint32_t));
+    if (field->vectors == NULL) {
+        return -1;
+    }
+    for (i = 0; i < field->count; i++) {
+        uint32_t *vector = field->vectors + i * acl->words;
+        for (r = 0; r < acl->count; r++) {
+            if (sr_acl_rule_has(&acl->rules[r], id, bounds[i])) {
+                vector[r / 32] |= (uint32_t) 1 << (r % 32);
+            }
+        }
+    }
+    return 0;
+}
+
+/* The vector of the interval holding v */
+static const uint32_t *sr_acl_lookup(const struct sr_acl *acl,
+                                     const struct sr_acl_field *field,
+                                     uint32_t v)
+{
+    unsigned int lo = 0, hi = field->count - 1;
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi + 1) / 2;
+        if (field->starts[mid] <= v) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return field->vectors + lo * acl->words;
+}
+
+static void sr_acl_free_field(struct sr_acl_field *field)
+{
+    free(field->starts);
+    free(field->vectors);
+    field->starts = NULL;
+    field->vectors = NULL;
+    field->count = 0;
+}
+
+struct sr_acl *sr_acl_create(void)
+{
+    struct sr_acl *acl = (struct sr_acl *) calloc(1, sizeof(struct sr_acl));
+    return acl;
+}
+
+void sr_acl_destroy(struct sr_acl *acl)
+{
+    if (acl == NULL) {
+        return;
+    }
+    sr_acl_free_field(&acl->src);
+    sr_acl_free_field(&acl->dst);
+    sr_acl_free_field(&acl->proto);
+    sr_acl_free_field(&acl->sport);
+    sr_acl_free_field(&acl->dport);
+    sr_acl_free_field(&acl->flags);
+    free(acl);
+}
+
+int sr_acl_add(struct sr_acl *acl, const struct sr_acl_rule *rule)
+{
+    if (acl->count == SR_ACL_MAX_RULES) {
+        return -1;
+    }
+    acl->rules[acl->count] = *rule;
+    acl->rules[acl->count].hits = 0;
+    acl->count++;
+    return 0;
+}
+
+int sr_acl_compile(struct sr_acl *acl)
+{
+    assert(acl);
+
+    sr_acl_free_field(&acl->src);
+    sr_acl_free_field(&acl->dst);
+    sr_acl_free_field(&acl->proto);
+    sr_acl_free_field(&acl->sport);
+    sr_acl_free_field(&acl->dport);
+    sr_acl_free_field(&acl->flags);
+    acl->words = (acl->count + 31) / 32;
+    if (acl->words == 0) {
+        return 0;
+    }
+    if (sr_acl_compile_field(acl, &acl->src, sr_acl_src) ||
+        sr_acl_compile_field(acl, &acl->dst, sr_acl_dst) ||
+        sr_acl_compile_field(acl, &acl->proto, sr_acl_proto) ||
+        sr_acl_compile_field(acl, &acl->sport, sr_acl_sport) ||
+        sr_acl_compile_field(acl, &acl->dport, sr_acl_dport) ||
+        sr_acl_compile_field(acl, &acl->flags, sr_acl_flags)) {
+        acl->words = 0;
+        return -1;
+    }
+    return 0;
+}
+
+sr_acl_action sr_acl_match(struct sr_acl *acl, sr_ip_hdr_t *iphdr,
+                           unsigned int ip_len)
+{
+    unsigned int hdr_len = iphdr->ip_hl * 4;
+    uint16_t sport = 0, dport = 0;
+    uint8_t flags = 0;
+    unsigned int w;
+
+    if (acl->words == 0) {
+        acl->permits++;
+        return sr_acl_permit;
+    }
+    if ((ntohs(iphdr->ip_off) & IP_OFFMASK) == 0 &&
+        (iphdr->ip_p == ip_protocol_tcp || iphdr->ip_p == ip_protocol_udp) &&
+        ip_len >= hdr_len + 4) {
+        uint8_t *l4 = (uint8_t *) iphdr + hdr_len;
+        sport = (l4[0] << 8) | l4[1];
+        dport = (l4[2] << 8) | l4[3];
+        if (iphdr->ip_p == ip_protocol_tcp && ip_len >= hdr_len + 14) {
+            flags = l4[13];
+        }
+    }
+
+    const uint32_t *src = sr_acl_lookup(acl, &acl->src, ntohl(iphdr->ip_src));
+    const uint32_t *dst = sr_acl_lookup(acl, &acl->dst, ntohl(iphdr->ip_dst));
+    const uint32_t *proto = sr_acl_lookup(acl, &acl->proto, iphdr->ip_p);
+    const uint32_t *sp = sr_acl_lookup(acl, &acl->sport, sport);
+    const uint32_t *dp = sr_acl_lookup(acl, &acl->dport, dport);
+    const uint32_t *fl = sr_acl_lookup(acl, &acl->flags, flags);
+
+    for (w = 0; w < acl->words; w++) {
+        uint32_t bits = src[w] & dst[w] & proto[w] & sp[w] & dp[w] & fl[w];
+        if (bits) {
+            unsigned int r = w * 32;
+            while (!(bits & 1)) {
+                bits >>= 1;
+                r++;
+            }
+            acl->rules[r].hits++;
+            return acl->rules[r].action;
+        }
+    }
+    acl->permits++;
+    return sr_acl_permit;
+}
+
+/* a.b.c.d/len or any, as an inclusive range in host order */
+static int sr_acl_parse_prefix(char *text, uint32_t *lo, uint32_t *hi)
+{
+    struct in_addr addr;
+    char *slash;
+    int len = 32;
+
+    if (strcmp(text, "any") == 0) {
+        *lo = 0;
+        *hi = 0xffffffff;
+        return 0;
+    }
+    slash = strchr(text, '/');
+    if (slash) {
+        *slash = '\0';
+        len = atoi(slash + 1);
+    }
+    if (inet_aton(text, &addr) == 0 || len < 0 || len > 32) {
+        return -1;
+    }
+    uint32_t mask = len ? 0xffffffff << (32 - len) : 0;
+    *lo = ntohl(addr.s_addr) & mask;
+    *hi = *lo | ~mask;
+    return 0;
+}
+
+/* n, n-m or any */
+static int sr_acl_parse_ports(char *text, uint16_t *lo, uint16_t *hi)
+{
+    char *dash;
+    int first, last;
+
+    if (text == NULL || strcmp(text, "any") == 0) {
+        *lo = 0;
+        *hi = 0xffff;
+        return 0;
+    }
+    dash = strchr(text, '-');
+    first = atoi(text);
+    last = dash ? atoi(dash + 1) : first;
+    if (first < 0 || last > 0xffff || first > last) {
+        return -1;
+    }
+    *lo = first;
+    *hi = last;
+    return 0;
+}
+
+/* set/mask in flag letters, or any */
+static int sr_acl_parse_flags(char *text, uint8_t *flags, uint8_t *mask)
+{
+    uint8_t *out = flags;
+    const char *bit;
+
+    *flags = 0;
+    *mask = 0;
+    if (text == NULL || strcmp(text, "any") == 0) {
+        return 0;
+    }
+    for (; *text; text++) {
+        if (*text == '/') {
+            out = mask;
+            continue;
+        }
+        bit = strchr(sr_acl_flag_names, *text);
+        if (bit == NULL) {
+            return -1;
+        }
+        *out |= 1 << (bit - sr_acl_flag_names);
+    }
+    if (out != mask) {
+        /* No mask: the given flags must be set, others don't matter */
+        *mask = *flags;
+    }
+    return (*flags & ~*mask) ? -1 : 0;
+}
+
+int sr_acl_load(struct sr_instance *sr, const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    char line[BUFSIZ];
+    unsigned int lineno = 0;
+    struct sr_if *iface;
+    int dir;
+
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *field[9];
+        unsigned int n = 0, i;
+        struct sr_acl_rule rule;
+        char *hash = strchr(line, '#');
+        char *token;
+
+        lineno++;
+        if (hash) {
+            *hash = '\0';
+        }
+        for (token = strtok(line, " \t\r\n"); token && n < 9;
+             token = strtok(NULL, " \t\r\n")) {
+            field[n++] = token;
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (n < 6 || token) {
+            goto bad;
+        }
+        for (i = n; i < 9; i++) {
+            field[i] = NULL;
+        }
+
+        iface = sr_get_interface(sr, field[0]);
+        if (iface == NULL) {
+            goto bad;
+        }
+        if (strcmp(field[1], "in") == 0) {
+            dir = sr_acl_in;
+        } else if (strcmp(field[1], "out") == 0) {
+            dir = sr_acl_out;
+        } else {
+            goto bad;
+        }
+
+        memset(&rule, 0, sizeof(rule));
+        if (strcmp(field[2], "permit") == 0) {
+            rule.action = sr_acl_permit;
+        } else if (strcmp(field[2], "deny") == 0) {
+            rule.action = sr_acl_deny;
+        } else {
+            goto bad;
+        }
+        if (strcmp(field[3], "any") == 0) {
+            rule.proto_lo = 0;
+            rule.proto_hi = 0xff;
+        } else {
+            int proto = strcmp(field[3], "tcp") == 0 ? ip_protocol_tcp :
+                        strcmp(field[3], "udp") == 0 ? ip_protocol_udp :
+                        strcmp(field[3], "icmp") == 0 ? ip_protocol_icmp :
+                        atoi(field[3]);
+            if (proto <= 0 || proto > 0xff) {
+                goto bad;
+            }
+            rule.proto_lo = rule.proto_hi = proto;
+        }
+        if (sr_acl_parse_prefix(field[4], &rule.src_lo, &rule.src_hi) ||
+            sr_acl_parse_prefix(field[5], &rule.dst_lo, &rule.dst_hi) ||
+            sr_acl_parse_ports(field[6], &rule.sport_lo, &rule.sport_hi) ||
+            sr_acl_parse_ports(field[7], &rule.dport_lo, &rule.dport_hi) ||
+            sr_acl_parse_flags(field[8], &rule.flags, &rule.flags_mask)) {
+            goto bad;
+        }
+        /* Ports and flags only exist for some protocols */
+        if ((rule.sport_lo != 0 || rule.sport_hi != 0xffff ||
+             rule.dport_lo != 0 || rule.dport_hi != 0xffff) &&
+            (rule.proto_lo != rule.proto_hi ||
+             (rule.proto_lo != ip_protocol_tcp && rule.proto_lo != ip_protocol_udp))) {
+            goto bad;
+        }
+        if (rule.flags_mask && rule.proto_lo != ip_protocol_tcp) {
+            goto bad;
+        }
+
+        if (iface->acl[dir] == NULL) {
+            iface->acl[dir] = sr_acl_create();
+            assert(iface->acl[dir]);
+        }
+        if (sr_acl_add(iface->acl[dir], &rule)) {
+            fprintf(stderr, "%s:%u: more than %d rules on %s\n",
+                    filename, lineno, SR_ACL_MAX_RULES, iface->name);
+            fclose(fp);
+            return -1;
+        }
+        continue;
+bad:
+        fprintf(stderr, "%s:%u: bad filter rule\n", filename, lineno);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        for (dir = 0; dir < sr_acl_dir_count; dir++) {
+            if (iface->acl[dir] && sr_acl_compile(iface->acl[dir])) {
+                fprintf(stderr, "Out of memory compiling filters\n");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+void sr_acl_dump(struct sr_instance *sr)
+{
+    struct sr_if *iface;
+    unsigned int dir, r;
+
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        for (dir = 0; dir < sr_acl_dir_count; dir++) {
+            struct sr_acl *acl = iface->acl[dir];
+            if (acl == NULL) {
+                continue;
+            }
+            fprintf(stderr, "Filter %s %s:", iface->name,
+                    dir == sr_acl_in ? "in" : "out");
+            for (r = 0; r < acl->count; r++) {
+                fprintf(stderr, " %lu", acl->rules[r].hits);
+            }
+            fprintf(stderr, ", unmatched %lu\n", acl->permits);
+        }
+    }
+}
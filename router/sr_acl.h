@@ -0,0 +1,97 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_acl.h
+ *
+ * Description:
+ *
+ * Packet filters attached to an interface, one per direction. A filter is
+ * an ordered list of rules over source and destination prefix, protocol,
+ * port ranges and TCP flags; the first rule matching a packet decides,
+ * and a packet no rule matches is permitted.
+ *
+ * Rules are compiled for bit-vector classification: each field's value
+ * space is cut into the elementary intervals the rules' bounds make, and
+ * every interval carries the set of rules matching it as a bit vector.
+ * Classifying a packet is a binary search per field and an AND of the
+ * vectors, whose first set bit is the deciding rule, so the cost barely
+ * grows with the number of rules.
+ *
+ * Filters are built before packets flow and read-only afterwards, apart
+ * from the hit counters.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ACL_H
+#define SR_ACL_H
+
+#include <stdint.h>
+#include "sr_protocol.h"
+
+struct sr_instance;
+
+typedef enum {
+  sr_acl_permit,
+  sr_acl_deny
+} sr_acl_action;
+
+typedef enum {
+  sr_acl_in,
+  sr_acl_out,
+  sr_acl_dir_count
+} sr_acl_dir;
+
+/* Rules per filter */
+#define SR_ACL_MAX_RULES 1024
+
+/* Ranges are inclusive and in host byte order. */
+struct sr_acl_rule {
+  sr_acl_action action;
+  uint32_t src_lo, src_hi;
+  uint32_t dst_lo, dst_hi;
+  uint8_t proto_lo, proto_hi;
+  uint16_t sport_lo, sport_hi;
+  uint16_t dport_lo, dport_hi;
+  uint8_t flags_mask; /* TCP flags under the mask must equal flags */
+  uint8_t flags;
+  unsigned long hits;
+};
+
+/* One field compiled: sorted interval starts, and for each the bit vector
+   of the rules matching every value from it up to the next start. */
+struct sr_acl_field {
+  unsigned int count;
+  uint32_t *starts;
+  uint32_t *vectors; /* count * words */
+};
+
+struct sr_acl {
+  unsigned int count;
+  struct sr_acl_rule rules[SR_ACL_MAX_RULES];
+  unsigned int words; /* 32 bit words in a vector, 0 until compiled */
+  struct sr_acl_field src, dst, proto, sport, dport, flags;
+  unsigned long permits; /* packets no rule matched */
+};
+
+struct sr_acl *sr_acl_create(void);
+void  sr_acl_destroy(struct sr_acl *acl);
+
+/* Append a rule; -1 if the filter is full. */
+int   sr_acl_add(struct sr_acl *acl, const struct sr_acl_rule *rule);
+
+/* Build the classifier from the rules added so far. */
+int   sr_acl_compile(struct sr_acl *acl);
+
+/* Decide on an IP packet of ip_len bytes. Fragments after the first carry
+   no ports or flags, and are classified with both as 0. */
+sr_acl_action sr_acl_match(struct sr_acl *acl, sr_ip_hdr_t *iphdr,
+                           unsigned int ip_len);
+
+/* Load rules from a file into the interfaces' filters and compile them.
+   One rule per line, '#' starts a comment:
+     iface in|out permit|deny proto|any src|any dst|any [sport [dport [flags]]]
+   with prefixes as a.b.c.d/len, ports as n or n-m or any, and flags as
+   set/mask over FSRPAUEC (e.g. S/SA: SYN without ACK). */
+int   sr_acl_load(struct sr_instance *sr, const char *filename);
+
+void  sr_acl_dump(struct sr_instance *sr);
+
+#endif /* -- SR_ACL_H -- */
@@ -8,6 +8,7 @@
 #include <string.h>
 #include "sr_arpcache.h"
 #include "sr_router.h"
+#include "sr_stats.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
 
@@ -32,20 +33,36 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
+    int slot = -1;
+    return sr_arpcache_lookup_slot(cache, ip, &slot);
+}
+
+/* Same as sr_arpcache_lookup, trying the cached slot index first. */
+struct sr_arpentry *sr_arpcache_lookup_slot(struct sr_arpcache *cache,
+                                            uint32_t ip, int *slot) {
     pthread_mutex_lock(&(cache->lock));
     
     struct sr_arpentry *entry = NULL, *copy = NULL;
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
+    int i = *slot;
+    if ((i >= 0) && (i < SR_ARPCACHE_SZ) &&
+        (cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
+        entry = &(cache->entries[i]);
+    } else {
+        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+            if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
+                entry = &(cache->entries[i]);
+                *slot = i;
+                break;
+            }
         }
     }
     
     /* Must return a copy b/c another thread could jump in and modify
        table after we return. */
     if (entry) {
+        /* Mark the entry as in use so it gets refreshed before expiry */
+        entry->used = time(NULL);
         copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
         memcpy(copy, entry, sizeof(struct sr_arpentry));
     }
@@ -95,6 +112,24 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
         strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
         new_pkt->next = req->packets;
         req->packets = new_pkt;
+        sr_stats_count(sr_stats_arp_queued);
+
+        /* A host that doesn't answer mustn't pile up a backlog: drop the
+           packet that has waited longest, it is the least use by now */
+        if (++req->npackets > SR_ARPREQ_MAX_PACKETS) {
+            struct sr_packet *prev = req->packets;
+            while (prev->next->next) {
+                prev = prev->next;
+            }
+            if (prev->next->buf)
+                free(prev->next->buf);
+            if (prev->next->iface)
+                free(prev->next->iface);
+            free(prev->next);
+            prev->next = NULL;
+            req->npackets--;
+            sr_stats_drop(sr_stats_drop_arp_queue);
+        }
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -108,7 +143,8 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
    2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip)
+                                     uint32_t ip,
+                                     char *iface)
 {
     pthread_mutex_lock(&(cache->lock));
     
@@ -129,16 +165,29 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
         prev = req;
     }
     
+    /* Refresh the existing entry for this IP if there is one (e.g. the
+       reply to a refresh probe), otherwise take the first free slot. */
     int i;
     for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if (!(cache->entries[i].valid))
+        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip))
             break;
     }
     
+    if (i == SR_ARPCACHE_SZ) {
+        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+            if (!(cache->entries[i].valid))
+                break;
+        }
+        if (i != SR_ARPCACHE_SZ)
+            cache->entries[i].used = 0;
+    }
+    
     if (i != SR_ARPCACHE_SZ) {
         memcpy(cache->entries[i].mac, mac, 6);
         cache->entries[i].ip = ip;
         cache->entries[i].added = time(NULL);
+        cache->entries[i].probed = 0;
+        strncpy(cache->entries[i].iface, iface, sr_IFACE_NAMELEN);
         cache->entries[i].valid = 1;
     }
     
@@ -187,6 +236,13 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
     pthread_mutex_unlock(&(cache->lock));
 }
 
+/* Sets the lifetime of cache entries in seconds. */
+void sr_arpcache_set_timeout(struct sr_arpcache *cache, double timeout) {
+    pthread_mutex_lock(&(cache->lock));
+    cache->timeout = timeout;
+    pthread_mutex_unlock(&(cache->lock));
+}
+
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache) {
     fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
@@ -210,6 +266,7 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
     /* Invalidate all entries */
     memset(cache->entries, 0, sizeof(cache->entries));
     cache->requests = NULL;
+    cache->timeout = SR_ARPCACHE_TO;
     
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
@@ -225,13 +282,16 @@ int sr_arpcache_destroy(struct sr_arpcache *cache) {
 }
 
 /* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
+   more than cache->timeout seconds ago. Entries that are still in use are
+   probed with a unicast ARP request first and only invalidated if that
+   probe goes unanswered. */
 void *sr_arpcache_timeout(void *sr_ptr) {
     struct sr_instance *sr = sr_ptr;
     struct sr_arpcache *cache = &(sr->cache);
     
     while (1) {
         sleep(1.0);
+        sr_stats_poll(sr);
         
         pthread_mutex_lock(&(cache->lock));
     
@@ -239,8 +299,18 @@ void *sr_arpcache_timeout(void *sr_ptr) {
         
         int i;    
         for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
+            struct sr_arpentry *entry = &(cache->entries[i]);
+            if (!entry->valid)
+                continue;
+            
+            double age = difftime(curtime, entry->added);
+            if (age > cache->timeout) {
+                entry->valid = 0;
+            } else if ((age >= cache->timeout - SR_ARPCACHE_REFRESH) &&
+                       (entry->used >= entry->added) &&
+                       (difftime(curtime, entry->probed) >= 1.0)) {
+                sr_sendARPProbe(sr, entry->ip, entry->mac, entry->iface);
+                entry->probed = curtime;
             }
         }
         
@@ -73,6 +73,8 @@
 
 #define SR_ARPCACHE_SZ    100  
 #define SR_ARPCACHE_TO    15.0
+#define SR_ARPCACHE_REFRESH 3.0  /* Probe entries in use this long before expiry */
+#define SR_ARPREQ_MAX_PACKETS 32 /* Packets held per request; the oldest go first */
 
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
@@ -85,6 +87,9 @@ struct sr_arpentry {
     unsigned char mac[6]; 
     uint32_t ip;                /* IP addr in network byte order */
     time_t added;         
+    time_t used;                /* Last time a lookup hit this entry */
+    time_t probed;              /* Last refresh probe sent, 0 if none */
+    char iface[sr_IFACE_NAMELEN]; /* Interface the mapping was learned on */
     int valid;
 };
 
@@ -95,13 +100,16 @@ struct sr_arpreq {
                                    never sent, will be 0. */
     uint32_t times_sent;        /* Number of times this request was sent. You 
                                    should update this. */
-    struct sr_packet *packets;  /* List of pkts waiting on this req to finish */
+    struct sr_packet *packets;  /* List of pkts waiting on this req to finish,
+                                   newest first */
+    unsigned int npackets;      /* Length of packets */
     struct sr_arpreq *next;
 };
 
 struct sr_arpcache {
     struct sr_arpentry entries[SR_ARPCACHE_SZ];
     struct sr_arpreq *requests;
+    double timeout;             /* Entry lifetime in seconds */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
@@ -110,6 +118,13 @@ struct sr_arpcache {
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
 
+/* Same as sr_arpcache_lookup, but first tries the cache slot *slot (if it
+   is not -1) and stores the slot the entry was found in back into *slot,
+   so callers that resolve the same IP repeatedly (e.g. a route's gateway)
+   skip the scan. You must free the returned structure if it is not NULL. */
+struct sr_arpentry *sr_arpcache_lookup_slot(struct sr_arpcache *cache,
+                                            uint32_t ip, int *slot);
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
    that corresponds to this ARP request. The packet argument should not be
@@ -126,22 +141,35 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
-   2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
+   2) Inserts this IP to MAC mapping in the cache, and marks it valid. An
+      existing entry for the IP is refreshed in place. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip);
+                                     uint32_t ip,
+                                     char *iface);
 
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry);
 
+/* Sets the lifetime of cache entries in seconds. Safe to call while the
+   router is running. */
+void sr_arpcache_set_timeout(struct sr_arpcache *cache, double timeout);
+
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache);
 
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
-   a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   a destructor, and a cleanup thread times out cache entries after
+   cache->timeout seconds (SR_ARPCACHE_TO by default).
+
+   Entries that have been looked up since they were added are not simply
+   dropped at expiry: SR_ARPCACHE_REFRESH seconds before they expire the
+   cleanup thread sends a unicast ARP request to the cached MAC once a
+   second. Forwarding keeps using the old MAC meanwhile, and the reply
+   refreshes the entry through sr_arpcache_insert. Only if no reply comes
+   back before the deadline is the entry invalidated. */
 
 int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
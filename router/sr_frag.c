@@ -0,0 +1,394 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_frag.c
+ *
+ * Description:
+ *
+ * IPv4 fragment tracking and reassembly, see sr_frag.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_frag.h"
+#include "sr_utils.h"
+
+/* Buckets in the datagram table, a power of two */
+#define SR_FRAG_BUCKETS 256
+
+#define sr_frag_ip(packet) \
+    ((sr_ip_hdr_t *) ((packet) + sizeof(sr_ethernet_hdr_t)))
+#define sr_frag_offset(iphdr) \
+    ((uint32_t) (ntohs((iphdr)->ip_off) & IP_OFFMASK) * 8)
+#define sr_frag_payload(iphdr) \
+    ((uint32_t) ntohs((iphdr)->ip_len) - (iphdr)->ip_hl * 4)
+
+static struct sr_frag **sr_frag_bucket(struct sr_frag_table *table,
+                                       sr_ip_hdr_t *iphdr)
+{
+    uint32_t h = iphdr->ip_src ^ iphdr->ip_dst ^
+                 ((uint32_t) iphdr->ip_id << 16) ^ iphdr->ip_p;
+    h *= 0x9e3779b1;
+    return &table->buckets[(h ^ (h >> 16)) & table->mask];
+}
+
+/* Find the datagram of a fragment, creating it if create is set and the
+   limits allow. */
+static struct sr_frag *sr_frag_find(struct sr_frag_table *table,
+                                    sr_ip_hdr_t *iphdr, int create,
+                                    uint32_t now)
+{
+    struct sr_frag **bucket = sr_frag_bucket(table, iphdr);
+    struct sr_frag *frag;
+
+    for (frag = *bucket; frag; frag = frag->next) {
+        if (frag->ip_src == iphdr->ip_src && frag->ip_dst == iphdr->ip_dst &&
+            frag->id == iphdr->ip_id && frag->proto == iphdr->ip_p) {
+            return frag;
+        }
+    }
+    if (!create || table->count >= table->max_datagrams) {
+        return NULL;
+    }
+
+    frag = (struct sr_frag *) sr_slab_alloc(&table->pool);
+    if (frag == NULL) {
+        return NULL;
+    }
+    memset(frag, 0, sizeof(struct sr_frag));
+    frag->ip_src = iphdr->ip_src;
+    frag->ip_dst = iphdr->ip_dst;
+    frag->id = iphdr->ip_id;
+    frag->proto = iphdr->ip_p;
+    frag->created = now;
+    frag->next = *bucket;
+    *bucket = frag;
+    table->count++;
+    return frag;
+}
+
+/* Mark the payload bytes a fragment carries as received. Returns 1 if it
+   brings bytes not seen before, 0 if it brings none, and -1 if it doesn't
+   fit what is known of the datagram or would split it into too many
+   pieces. */
+static int sr_frag_cover(struct sr_frag *frag, sr_ip_hdr_t *iphdr)
+{
+    uint32_t start = sr_frag_offset(iphdr);
+    uint32_t end = start + sr_frag_payload(iphdr);
+    int last = !(ntohs(iphdr->ip_off) & IP_MF);
+    unsigned int i, j;
+
+    if (last) {
+        if ((frag->total && frag->total != end) ||
+            (frag->extents && frag->extent[frag->extents - 1].end > end)) {
+            return -1;
+        }
+    } else if (frag->total && end > frag->total) {
+        return -1;
+    }
+
+    /* Extents i to j-1 overlap or touch [start, end) */
+    for (i = 0; i < frag->extents && frag->extent[i].end < start; i++) {
+    }
+    for (j = i; j < frag->extents && frag->extent[j].start <= end; j++) {
+    }
+
+    if (start == end ||
+        (j == i + 1 && frag->extent[i].start <= start &&
+         frag->extent[i].end >= end)) {
+        if (last && frag->total == 0) {
+            frag->total = end;
+            return 1;
+        }
+        return 0;
+    }
+    if (j == i) {
+        if (frag->extents == SR_FRAG_EXTENTS) {
+            return -1;
+        }
+        memmove(&frag->extent[i + 1], &frag->extent[i],
+                (frag->extents - i) * sizeof(struct sr_frag_extent));
+        frag->extent[i].start = start;
+        frag->extent[i].end = end;
+        frag->extents++;
+    } else {
+        if (start < frag->extent[i].start) {
+            frag->extent[i].start = start;
+        }
+        frag->extent[i].end = end > frag->extent[j - 1].end ?
+                              end : frag->extent[j - 1].end;
+        memmove(&frag->extent[i + 1], &frag->extent[j],
+                (frag->extents - j) * sizeof(struct sr_frag_extent));
+        frag->extents -= j - i - 1;
+    }
+    if (last) {
+        frag->total = end;
+    }
+    return 1;
+}
+
+/* Every byte from 0 to the end of the last fragment received */
+#define sr_frag_complete(frag) \
+    ((frag)->total && (frag)->extents == 1 && \
+     (frag)->extent[0].start == 0 && (frag)->extent[0].end == (frag)->total)
+
+/* Hold a copy of a fragment. Returns -1 if over the byte limit. */
+static int sr_frag_hold(struct sr_frag_table *table, struct sr_frag *frag,
+                        uint8_t *packet, unsigned int len)
+{
+    if (table->bytes + len > table->max_bytes) {
+        return -1;
+    }
+    struct sr_frag_piece *piece =
+        (struct sr_frag_piece *) malloc(sizeof(struct sr_frag_piece) + len);
+    if (piece == NULL) {
+        return -1;
+    }
+    piece->buf = (uint8_t *) (piece + 1);
+    piece->len = len;
+    memcpy(piece->buf, packet, len);
+    piece->next = frag->pieces;
+    frag->pieces = piece;
+    frag->buffered += len;
+    table->bytes += len;
+    return 0;
+}
+
+/* Give back the copy sr_frag_hold took last */
+static void sr_frag_unhold(struct sr_frag_table *table, struct sr_frag *frag)
+{
+    struct sr_frag_piece *piece = frag->pieces;
+
+    frag->pieces = piece->next;
+    frag->buffered -= piece->len;
+    table->bytes -= piece->len;
+    free(piece);
+}
+
+/* Unlink a datagram and release it with whatever it still holds */
+static void sr_frag_release(struct sr_frag_table *table, struct sr_frag *frag)
+{
+    sr_ip_hdr_t key;
+    key.ip_src = frag->ip_src;
+    key.ip_dst = frag->ip_dst;
+    key.ip_id = frag->id;
+    key.ip_p = frag->proto;
+
+    struct sr_frag **pp = sr_frag_bucket(table, &key);
+    while (*pp != frag) {
+        pp = &(*pp)->next;
+    }
+    *pp = frag->next;
+
+    table->bytes -= frag->buffered;
+    sr_frag_free_pieces(frag->pieces);
+    sr_slab_free(&table->pool, frag);
+    table->count--;
+}
+
+int sr_frag_init(struct sr_frag_table *table, sr_frag_mode mode,
+                 unsigned int max_datagrams, unsigned int max_bytes,
+                 unsigned int timeout)
+{
+    assert(table);
+
+    table->mode = mode;
+    table->mask = SR_FRAG_BUCKETS - 1;
+    table->buckets = (struct sr_frag **) calloc(SR_FRAG_BUCKETS,
+                                                sizeof(struct sr_frag *));
+    table->count = 0;
+    table->max_datagrams = max_datagrams;
+    table->bytes = 0;
+    table->max_bytes = max_bytes;
+    table->timeout = timeout;
+    table->drops = 0;
+    if (table->buckets == NULL) {
+        return -1;
+    }
+    return sr_slab_init(&table->pool, "Fragmented datagram",
+                        sizeof(struct sr_frag), 0, 0);
+}
+
+void sr_frag_destroy(struct sr_frag_table *table)
+{
+    uint32_t i;
+    for (i = 0; i <= table->mask; i++) {
+        while (table->buckets[i]) {
+            sr_frag_release(table, table->buckets[i]);
+        }
+    }
+    free(table->buckets);
+    table->buckets = NULL;
+    sr_slab_destroy(&table->pool);
+}
+
+void sr_frag_expire(struct sr_frag_table *table, uint32_t now)
+{
+    uint32_t i;
+    struct sr_frag *frag, *next;
+
+    for (i = 0; i <= table->mask; i++) {
+        for (frag = table->buckets[i]; frag; frag = next) {
+            next = frag->next;
+            if (now - frag->created >= table->timeout) {
+                struct sr_frag_piece *piece;
+                for (piece = frag->pieces; piece; piece = piece->next) {
+                    table->drops++;
+                }
+                sr_frag_release(table, frag);
+            }
+        }
+    }
+}
+
+uint8_t *sr_frag_reassemble(struct sr_frag_table *table, uint8_t *packet,
+                            unsigned int len, unsigned int *out_len,
+                            uint32_t now)
+{
+    sr_ip_hdr_t *iphdr = sr_frag_ip(packet);
+    struct sr_frag *frag = sr_frag_find(table, iphdr, 1, now);
+
+    if (frag == NULL || sr_frag_hold(table, frag, packet, len)) {
+        table->drops++;
+        return NULL;
+    }
+    /* Held first, so every byte counted as covered is in a piece */
+    int covered = sr_frag_cover(frag, iphdr);
+    if (covered <= 0) {
+        /* Refused, or a duplicate of what is held */
+        sr_frag_unhold(table, frag);
+        if (covered < 0) {
+            table->drops++;
+        }
+        return NULL;
+    }
+    if (!sr_frag_complete(frag)) {
+        return NULL;
+    }
+
+    /* Headers come from the first fragment */
+    struct sr_frag_piece *piece;
+    sr_ip_hdr_t *first = NULL;
+    for (piece = frag->pieces; piece; piece = piece->next) {
+        if (sr_frag_offset(sr_frag_ip(piece->buf)) == 0) {
+            first = sr_frag_ip(piece->buf);
+            break;
+        }
+    }
+    if (first == NULL || first->ip_hl * 4 + frag->total > 0xffff) {
+        /* Longer than an IP datagram can be */
+        table->drops++;
+        sr_frag_release(table, frag);
+        return NULL;
+    }
+
+    unsigned int hdr_len = sizeof(sr_ethernet_hdr_t) + first->ip_hl * 4;
+    uint8_t *whole = (uint8_t *) malloc(hdr_len + frag->total);
+    if (whole == NULL) {
+        return NULL;
+    }
+    memcpy(whole, piece->buf, hdr_len);
+
+    for (piece = frag->pieces; piece; piece = piece->next) {
+        sr_ip_hdr_t *ip = sr_frag_ip(piece->buf);
+        uint32_t off = sr_frag_offset(ip);
+        uint32_t plen = sr_frag_payload(ip);
+        unsigned int src = sizeof(sr_ethernet_hdr_t) + ip->ip_hl * 4;
+        if (off + plen > frag->total || src + plen > piece->len) {
+            continue;
+        }
+        memcpy(whole + hdr_len + off, piece->buf + src, plen);
+    }
+
+    sr_ip_hdr_t *ip = sr_frag_ip(whole);
+    ip->ip_len = htons(first->ip_hl * 4 + frag->total);
+    ip->ip_off = htons(ntohs(ip->ip_off) & IP_DF);
+    ip->ip_sum = 0;
+    ip->ip_sum = cksum(ip, ip->ip_hl * 4);
+
+    *out_len = hdr_len + frag->total;
+    sr_frag_release(table, frag);
+    return whole;
+}
+
+struct sr_frag_piece *sr_frag_translated(struct sr_frag_table *table,
+                                         sr_ip_hdr_t *orig,
+                                         uint32_t new_src, uint32_t new_dst,
+                                         uint32_t now)
+{
+    struct sr_frag *frag = sr_frag_find(table, orig, 1, now);
+    if (frag == NULL) {
+        /* Later fragments will be dropped */
+        table->drops++;
+        return NULL;
+    }
+    frag->translated = 1;
+    frag->new_src = new_src;
+    frag->new_dst = new_dst;
+    sr_frag_cover(frag, orig);
+
+    /* Hand back the fragments that came early */
+    struct sr_frag_piece *pieces = frag->pieces;
+    struct sr_frag_piece *piece;
+    for (piece = pieces; piece; piece = piece->next) {
+        sr_frag_ip(piece->buf)->ip_src = new_src;
+        sr_frag_ip(piece->buf)->ip_dst = new_dst;
+    }
+    table->bytes -= frag->buffered;
+    frag->buffered = 0;
+    frag->pieces = NULL;
+
+    if (sr_frag_complete(frag)) {
+        sr_frag_release(table, frag);
+    }
+    return pieces;
+}
+
+int sr_frag_follow(struct sr_frag_table *table, uint8_t *packet,
+                   unsigned int len, uint32_t now)
+{
+    sr_ip_hdr_t *iphdr = sr_frag_ip(packet);
+    struct sr_frag *frag = sr_frag_find(table, iphdr, 1, now);
+
+    if (frag == NULL) {
+        table->drops++;
+        return -1;
+    }
+    if (!frag->translated) {
+        if (sr_frag_hold(table, frag, packet, len)) {
+            table->drops++;
+            return -1;
+        }
+        int covered = sr_frag_cover(frag, iphdr);
+        if (covered <= 0) {
+            sr_frag_unhold(table, frag);
+            if (covered < 0) {
+                table->drops++;
+            }
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Forwarded even if it doesn't fit; the datagram then just lingers
+       until it expires */
+    iphdr->ip_src = frag->new_src;
+    iphdr->ip_dst = frag->new_dst;
+    sr_frag_cover(frag, iphdr);
+    if (sr_frag_complete(frag)) {
+        sr_frag_release(table, frag);
+    }
+    return 1;
+}
+
+void sr_frag_free_pieces(struct sr_frag_piece *pieces)
+{
+    struct sr_frag_piece *next;
+    while (pieces) {
+        next = pieces->next;
+        free(pieces);
+        pieces = next;
+    }
+}
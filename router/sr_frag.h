@@ -0,0 +1,132 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_frag.h
+ *
+ * Description:
+ *
+ * Tracking of fragmented IPv4 datagrams, keyed by (src, dst, proto, id).
+ * Two modes:
+ *
+ *  - reassembly: fragments are copied until the datagram is complete, and
+ *    the whole datagram is handed back.
+ *  - virtual reassembly: the first fragment (the only one with transport
+ *    ports) is translated and forwarded as usual, and the addresses it was
+ *    translated to are recorded; later fragments are rewritten the same
+ *    way and forwarded at once. Only fragments arriving ahead of the first
+ *    are held.
+ *
+ * Completion is decided by the byte ranges received, kept as a short
+ * sorted list of disjoint extents, so duplicates and overlaps can't make
+ * a datagram with a hole look complete.
+ *
+ * Memory is bounded by a count of datagrams and of bytes held, and
+ * datagrams not completed within the timeout are dropped.
+ *
+ * The table does no locking of its own; callers serialize access (the NAT
+ * uses it only while holding nat->lock).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FRAG_H
+#define SR_FRAG_H
+
+#include <stdint.h>
+#include "sr_protocol.h"
+#include "sr_slab.h"
+
+typedef enum {
+  sr_frag_mode_virtual,
+  sr_frag_mode_reassemble
+} sr_frag_mode;
+
+/* A fragment held as a whole ethernet frame */
+struct sr_frag_piece {
+  struct sr_frag_piece *next;
+  unsigned int len;
+  uint8_t *buf;
+};
+
+/* Disjoint byte ranges of payload received per datagram. A fragment that
+   would leave it in more pieces is refused. */
+#define SR_FRAG_EXTENTS 8
+
+/* Payload bytes [start, end) received */
+struct sr_frag_extent {
+  uint32_t start;
+  uint32_t end;
+};
+
+/* A datagram being reassembled or translated. Addresses as on the wire. */
+struct sr_frag {
+  uint32_t ip_src;
+  uint32_t ip_dst;
+  uint16_t id;
+  uint8_t proto;
+  uint8_t translated; /* first fragment seen and new_src/new_dst set */
+  uint32_t new_src;
+  uint32_t new_dst;
+  uint32_t total; /* payload bytes, 0 until the last fragment is seen */
+  struct sr_frag_extent extent[SR_FRAG_EXTENTS]; /* sorted by start */
+  unsigned int extents;
+  unsigned int buffered; /* bytes held in pieces */
+  uint32_t created; /* caller's clock, in seconds */
+  struct sr_frag_piece *pieces;
+  struct sr_frag *next; /* hash chain */
+};
+
+struct sr_frag_table {
+  sr_frag_mode mode;
+  struct sr_frag **buckets;
+  uint32_t mask;
+  unsigned int count; /* datagrams tracked */
+  unsigned int max_datagrams;
+  unsigned int bytes; /* bytes held in pieces, over all datagrams */
+  unsigned int max_bytes;
+  unsigned int timeout; /* seconds */
+  unsigned int drops; /* fragments refused for the limits or expired */
+  struct sr_slab pool;
+};
+
+/* Default limits */
+#define SR_FRAG_TIMEOUT 30
+#define SR_FRAG_MAX_DATAGRAMS 256
+#define SR_FRAG_MAX_BYTES (1 << 20)
+
+/* Whether the IP header is of a fragment */
+#define sr_frag_is_fragment(iphdr) \
+  ((ntohs((iphdr)->ip_off) & (IP_MF | IP_OFFMASK)) != 0)
+
+int   sr_frag_init(struct sr_frag_table *table, sr_frag_mode mode,
+                   unsigned int max_datagrams, unsigned int max_bytes,
+                   unsigned int timeout);
+void  sr_frag_destroy(struct sr_frag_table *table);
+
+/* Drop datagrams older than the timeout. */
+void  sr_frag_expire(struct sr_frag_table *table, uint32_t now);
+
+/* Reassembly mode: take a copy of the fragment in packet (an ethernet
+   frame). Returns the complete datagram as a new ethernet frame, with
+   its length in *out_len, once every fragment has arrived; the caller
+   frees it. NULL while incomplete or if the fragment was dropped;
+   exact duplicates are dropped. */
+uint8_t *sr_frag_reassemble(struct sr_frag_table *table, uint8_t *packet,
+                            unsigned int len, unsigned int *out_len,
+                            uint32_t now);
+
+/* Virtual mode: the first fragment, with original header orig, went out
+   translated to new_src/new_dst. Returns the fragments held for it,
+   already rewritten; the caller forwards them and frees the list with
+   sr_frag_free_pieces. */
+struct sr_frag_piece *sr_frag_translated(struct sr_frag_table *table,
+                                         sr_ip_hdr_t *orig,
+                                         uint32_t new_src, uint32_t new_dst,
+                                         uint32_t now);
+
+/* Virtual mode: a later fragment. Returns 1 if it was rewritten in place
+   and should be forwarded, 0 if a copy is held until the first fragment
+   arrives, -1 if it was dropped (or duplicates one held). */
+int   sr_frag_follow(struct sr_frag_table *table, uint8_t *packet,
+                     unsigned int len, uint32_t now);
+
+void  sr_frag_free_pieces(struct sr_frag_piece *pieces);
+
+#endif /* -- SR_FRAG_H -- */
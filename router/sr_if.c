@@ -65,6 +65,7 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
 void sr_add_interface(struct sr_instance* sr, const char* name)
 {
     struct sr_if* if_walker = 0;
+    int index;
 
     /* -- REQUIRES -- */
     assert(name);
@@ -76,19 +77,32 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
         sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
         assert(sr->if_list);
         sr->if_list->next = 0;
+        sr->if_list->mtu = SR_IF_DEFAULT_MTU;
+        sr->if_list->mss = 0;
+        sr->if_list->acl[sr_acl_in] = 0;
+        sr->if_list->acl[sr_acl_out] = 0;
+        sr->if_list->sched = 0;
+        sr->if_list->index = 0;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
         return;
     }
 
     /* -- find the end of the list -- */
     if_walker = sr->if_list;
+    index = 1;
     while(if_walker->next)
-    {if_walker = if_walker->next; }
+    {if_walker = if_walker->next; index++; }
 
     if_walker->next = (struct sr_if*)malloc(sizeof(struct sr_if));
     assert(if_walker->next);
     if_walker = if_walker->next;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
+    if_walker->mtu = SR_IF_DEFAULT_MTU;
+    if_walker->mss = 0;
+    if_walker->acl[sr_acl_in] = 0;
+    if_walker->acl[sr_acl_out] = 0;
+    if_walker->sched = 0;
+    if_walker->index = index;
     if_walker->next = 0;
 } /* -- sr_add_interface -- */ 
 
@@ -140,6 +154,76 @@ void sr_set_ether_ip(struct sr_instance* sr, uint32_t ip_nbo)
 
 } /* -- sr_set_ether_ip -- */
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_set_interface_mtu(..)
+ * Scope: Global
+ *
+ * set the IP MTU of the named interface, returns -1 if there is no
+ * such interface or the MTU is below SR_IF_MIN_MTU
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_set_interface_mtu(struct sr_instance* sr, const char* name, uint16_t mtu)
+{
+    struct sr_if* iface = sr_get_interface(sr, name);
+
+    if(iface == 0 || mtu < SR_IF_MIN_MTU)
+    { return -1; }
+
+    iface->mtu = mtu;
+    return 0;
+} /* -- sr_set_interface_mtu -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_set_interface_mss(..)
+ * Scope: Global
+ *
+ * clamp the MSS option of TCP SYNs the NAT sends out of the named
+ * interface to mss, and always to what fits its MTU. returns -1 if
+ * there is no such interface
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_set_interface_mss(struct sr_instance* sr, const char* name, uint16_t mss)
+{
+    struct sr_if* iface = sr_get_interface(sr, name);
+
+    if(iface == 0)
+    { return -1; }
+
+    iface->mss = mss;
+    return 0;
+} /* -- sr_set_interface_mss -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_set_interface_rate(..)
+ * Scope: Global
+ *
+ * shape IP packets forwarded out of the named interface to rate bytes a
+ * second with bursts of burst bytes, queueing them by DSCP class.
+ * returns -1 if there is no such interface, the rate is 0 or the
+ * scheduler can't be allocated
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_set_interface_rate(struct sr_instance* sr, const char* name,
+                          uint32_t rate, uint32_t burst)
+{
+    struct sr_if* iface = sr_get_interface(sr, name);
+    struct sr_sched* sched;
+
+    if(iface == 0 || rate == 0)
+    { return -1; }
+
+    sched = sr_sched_create(rate, burst, SR_SCHED_LIMIT);
+    if(sched == 0)
+    { return -1; }
+
+    sr_sched_destroy(iface->sched);
+    iface->sched = sched;
+    return 0;
+} /* -- sr_set_interface_rate -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_print_if_list(..)
  * Scope: Global
@@ -191,4 +275,9 @@ void sr_print_if(struct sr_if* iface)
     DebugMAC(iface->addr);
     Debug("\n");
     Debug("\tinet addr %s\n",inet_ntoa(ip_addr));
+    Debug("\tmtu %d\n",iface->mtu);
+    if(iface->mss)
+    { Debug("\tclamping tcp mss\n"); }
+    if(iface->sched)
+    { Debug("\tshaped to %u bytes/s\n", iface->sched->tb.rate); }
 } /* -- sr_print_if -- */
@@ -25,9 +25,19 @@
 #endif
 
 #include "sr_protocol.h"
+#include "sr_acl.h"
+#include "sr_sched.h"
 
 struct sr_instance;
 
+/* IP MTU of an interface unless configured otherwise, and the least
+   allowed (RFC 791) */
+#define SR_IF_DEFAULT_MTU 1500
+#define SR_IF_MIN_MTU 68
+
+/* mss value clamping TCP SYNs to the interface MTU alone */
+#define SR_IF_MSS_MTU 0xffff
+
 /* ----------------------------------------------------------------------------
  * struct sr_if
  *
@@ -41,6 +51,11 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  uint16_t mtu; /* largest IP datagram sent out of it */
+  uint16_t mss; /* MSS clamp for TCP SYNs sent out of it, 0 for none */
+  struct sr_acl* acl[sr_acl_dir_count]; /* filters by direction, 0 for none */
+  struct sr_sched* sched; /* egress shaper, 0 to send straight away */
+  int index; /* position in the list, for statistics */
   struct sr_if* next;
 };
 
@@ -48,6 +63,10 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name);
 void sr_add_interface(struct sr_instance*, const char*);
 void sr_set_ether_addr(struct sr_instance*, const unsigned char*);
 void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
+int sr_set_interface_mtu(struct sr_instance*, const char* name, uint16_t mtu);
+int sr_set_interface_mss(struct sr_instance*, const char* name, uint16_t mss);
+int sr_set_interface_rate(struct sr_instance*, const char* name,
+                          uint32_t rate, uint32_t burst);
 void sr_print_if_list(struct sr_instance*);
 void sr_print_if(struct sr_if*);
 
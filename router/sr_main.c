@@ -24,15 +24,21 @@
 #include <unistd.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#define __USE_MISC 1 /* force linux to show inet_aton */
+#include <arpa/inet.h>
 
 #ifdef _LINUX_
 #include <getopt.h>
+#include <signal.h>
 #endif /* _LINUX_ */
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
 #include "sr_nat.h"
+#include "sr_stats.h"
 
 extern char* optarg;
 
@@ -45,19 +51,50 @@ extern char* optarg;
 #define DEFAULT_SERVER "localhost"
 #define DEFAULT_RTABLE "rtable"
 #define DEFAULT_TOPO 0
+#define DEFAULT_ARP_TIMEOUT SR_ARPCACHE_TO
 /* NAT variables */
 #define DEFAULT_ICMP_MAPPING_TIMEOUT 60
+#define DEFAULT_UDP_MAPPING_TIMEOUT 300
 #define DEFAULT_TCP_SYN_TIMEOUT 7440
 #define DEFAULT_TCP_TRANS_IDLE_TIMEOUT 300
 #define DEFAULT_TCP_UNSOLICITED_INBOUND_SYN 6
+#define DEFAULT_TCP_FIN_TIMEOUT 60
+#define DEFAULT_TCP_CLOSED_TIMEOUT 10
+#define DEFAULT_NAT_POOL_MAPPINGS 1024
+#define DEFAULT_NAT_POOL_CONNS 4096
+#define DEFAULT_NAT_BLOCK_SIZE 256
+#define DEFAULT_NAT_MAX_BLOCKS 8
+#define DEFAULT_NAT_HOST_MAPPINGS 4096
+#define DEFAULT_NAT_HOST_CONNS 8192
+#define DEFAULT_NAT_HOST_PENDING 64
+#define DEFAULT_NAT_MAPPINGS 65536
+#define DEFAULT_NAT_CONNS 131072
+#define DEFAULT_NAT_PENDING 1024
+#define DEFAULT_NAT_MAPPING nat_endpoint_independent
+#define DEFAULT_NAT_FILTERING nat_endpoint_independent
 /* Whether NAT was set */
 #define DEFAULT_NAT 0
+/* ICMP the router sends, per second per type and per destination */
+#define DEFAULT_ICMP_TYPE_RATE 100
+#define DEFAULT_ICMP_SOURCE_RATE 10
+/* Interfaces that can be given an MTU */
+#define MAX_IF_MTUS 8
+/* Interfaces that can clamp TCP MSS */
+#define MAX_IF_MSS 8
+/* Interfaces that can be shaped */
+#define MAX_IF_RATES 8
 
 static void usage(char* );
 static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static sr_nat_behavior sr_parse_nat_behavior(char* name);
+static void sr_parse_nat_pool(struct sr_nat* nat, char* list);
+static void sr_parse_nat_det(struct sr_nat* nat, char* rule);
+static void sr_parse_if_mtu(struct sr_instance* sr, char* setting);
+static void sr_parse_if_mss(struct sr_instance* sr, char* setting);
+static void sr_parse_if_rate(struct sr_instance* sr, char* setting);
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -75,20 +112,51 @@ int main(int argc, char **argv)
 	unsigned int port = DEFAULT_PORT;
 	unsigned int topo = DEFAULT_TOPO;
 	char *logfile = 0;
+	double arp_timeout = DEFAULT_ARP_TIMEOUT;
+	unsigned int icmp_type_rate = DEFAULT_ICMP_TYPE_RATE;
+	unsigned int icmp_source_rate = DEFAULT_ICMP_SOURCE_RATE;
 	/**
 	 * NAT settings over here:
 	 */
 	unsigned int icmp_mto = DEFAULT_ICMP_MAPPING_TIMEOUT;
+	unsigned int udp_mto = DEFAULT_UDP_MAPPING_TIMEOUT;
 	unsigned int tcp_syn_mto = DEFAULT_TCP_SYN_TIMEOUT;
 	unsigned int tcp_idle_mto = DEFAULT_TCP_TRANS_IDLE_TIMEOUT;
 	unsigned int tcp_unsolicited_syn_mto = DEFAULT_TCP_UNSOLICITED_INBOUND_SYN;
+	unsigned int tcp_fin_mto = DEFAULT_TCP_FIN_TIMEOUT;
+	unsigned int tcp_closed_mto = DEFAULT_TCP_CLOSED_TIMEOUT;
+	unsigned int pool_mappings = DEFAULT_NAT_POOL_MAPPINGS;
+	unsigned int pool_conns = DEFAULT_NAT_POOL_CONNS;
+	sr_nat_behavior mapping_mode = DEFAULT_NAT_MAPPING;
+	sr_nat_behavior filtering_mode = DEFAULT_NAT_FILTERING;
+	char *ext_pool = 0;
+	char *static_file = 0;
+	char *acl_file = 0;
+	sr_frag_mode frag_mode = sr_frag_mode_virtual;
+	char *det_rules[SR_NAT_MAX_DET];
+	unsigned int det_count = 0;
+	char *if_mtus[MAX_IF_MTUS];
+	unsigned int if_mtu_count = 0;
+	char *if_mss[MAX_IF_MSS];
+	unsigned int if_mss_count = 0;
+	char *if_rates[MAX_IF_RATES];
+	unsigned int if_rate_count = 0;
+	struct sr_nat_limits limits;
+	limits.host_mappings = DEFAULT_NAT_HOST_MAPPINGS;
+	limits.host_conns = DEFAULT_NAT_HOST_CONNS;
+	limits.host_pending = DEFAULT_NAT_HOST_PENDING;
+	limits.mappings = DEFAULT_NAT_MAPPINGS;
+	limits.conns = DEFAULT_NAT_CONNS;
+	limits.pending = DEFAULT_NAT_PENDING;
+	unsigned int block_size = DEFAULT_NAT_BLOCK_SIZE;
+	unsigned int max_blocks = DEFAULT_NAT_MAX_BLOCKS;
 	int nat = DEFAULT_NAT;
 
 	struct sr_instance sr;
 
 	printf("Using %s\n", VERSION_INFO);
 
-	while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:")) != EOF)
+	while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:A:M:C:U:F:W:m:f:P:B:K:D:q:c:y:Q:L:Y:S:VO:X:a:i:j:b:")) != EOF)
 	{
 		switch (c)
 		{
@@ -120,6 +188,14 @@ int main(int argc, char **argv)
 		case 'T':
 			template = optarg;
 			break;
+		case 'i':
+			icmp_type_rate = atoi((char *) optarg);
+			printf("icmp per type per second: %d\n", icmp_type_rate);
+			break;
+		case 'j':
+			icmp_source_rate = atoi((char *) optarg);
+			printf("icmp per destination per second: %d\n", icmp_source_rate);
+			break;
 		case 'n':
 			nat = 1;
 			printf("nat: %d\n", nat);
@@ -136,11 +212,131 @@ int main(int argc, char **argv)
 			tcp_idle_mto = atoi((char *) optarg);
 			printf("tcp idle mto: %d\n", tcp_idle_mto);
 			break;
+		case 'F':
+			tcp_fin_mto = atoi((char *) optarg);
+			printf("tcp fin mto: %d\n", tcp_fin_mto);
+			break;
+		case 'W':
+			tcp_closed_mto = atoi((char *) optarg);
+			printf("tcp closed mto: %d\n", tcp_closed_mto);
+			break;
+		case 'U':
+			udp_mto = atoi((char *) optarg);
+			printf("udp mto: %d\n", udp_mto);
+			break;
+		case 'A':
+			arp_timeout = atof((char *) optarg);
+			printf("arp cache timeout: %.1f\n", arp_timeout);
+			break;
+		case 'M':
+			pool_mappings = atoi((char *) optarg);
+			printf("nat mapping pool: %d\n", pool_mappings);
+			break;
+		case 'C':
+			pool_conns = atoi((char *) optarg);
+			printf("nat connection pool: %d\n", pool_conns);
+			break;
+		case 'm':
+			mapping_mode = sr_parse_nat_behavior(optarg);
+			printf("nat mapping: %s\n", optarg);
+			break;
+		case 'f':
+			filtering_mode = sr_parse_nat_behavior(optarg);
+			printf("nat filtering: %s\n", optarg);
+			break;
+		case 'P':
+			ext_pool = optarg;
+			printf("nat address pool: %s\n", ext_pool);
+			break;
+		case 'D':
+			if (det_count == SR_NAT_MAX_DET) {
+				fprintf(stderr, "At most %d deterministic NAT prefixes\n", SR_NAT_MAX_DET);
+				exit(1);
+			}
+			det_rules[det_count++] = optarg;
+			printf("nat deterministic: %s\n", optarg);
+			break;
+		case 'O':
+			if (if_mtu_count == MAX_IF_MTUS) {
+				fprintf(stderr, "At most %d interface MTUs\n", MAX_IF_MTUS);
+				exit(1);
+			}
+			if_mtus[if_mtu_count++] = optarg;
+			printf("interface mtu: %s\n", optarg);
+			break;
+		case 'X':
+			if (if_mss_count == MAX_IF_MSS) {
+				fprintf(stderr, "At most %d interface MSS clamps\n", MAX_IF_MSS);
+				exit(1);
+			}
+			if_mss[if_mss_count++] = optarg;
+			printf("interface mss clamp: %s\n", optarg);
+			break;
+		case 'b':
+			if (if_rate_count == MAX_IF_RATES) {
+				fprintf(stderr, "At most %d shaped interfaces\n", MAX_IF_RATES);
+				exit(1);
+			}
+			if_rates[if_rate_count++] = optarg;
+			printf("interface rate: %s\n", optarg);
+			break;
+		case 'a':
+			acl_file = optarg;
+			printf("packet filters: %s\n", acl_file);
+			break;
+		case 'q':
+			limits.host_mappings = atoi((char *) optarg);
+			printf("nat mappings per host: %d\n", limits.host_mappings);
+			break;
+		case 'c':
+			limits.host_conns = atoi((char *) optarg);
+			printf("nat connections per host: %d\n", limits.host_conns);
+			break;
+		case 'y':
+			limits.host_pending = atoi((char *) optarg);
+			printf("nat pending syns per host: %d\n", limits.host_pending);
+			break;
+		case 'Q':
+			limits.mappings = atoi((char *) optarg);
+			printf("nat mappings: %d\n", limits.mappings);
+			break;
+		case 'L':
+			limits.conns = atoi((char *) optarg);
+			printf("nat connections: %d\n", limits.conns);
+			break;
+		case 'Y':
+			limits.pending = atoi((char *) optarg);
+			printf("nat pending syns: %d\n", limits.pending);
+			break;
+		case 'S':
+			static_file = optarg;
+			printf("nat forwarding rules: %s\n", static_file);
+			break;
+		case 'V':
+			frag_mode = sr_frag_mode_reassemble;
+			printf("nat reassembling fragments\n");
+			break;
+		case 'B':
+			block_size = atoi((char *) optarg);
+			/* Stored in 16 bits, and a block must fit an address's ports */
+			if (block_size == 0 || block_size > SR_NAT_PORT_MAX - SR_NAT_PORT_MIN + 1) {
+				fprintf(stderr, "NAT port block size must be 1 to %d\n",
+					SR_NAT_PORT_MAX - SR_NAT_PORT_MIN + 1);
+				exit(1);
+			}
+			printf("nat port block size: %d\n", block_size);
+			break;
+		case 'K':
+			max_blocks = atoi((char *) optarg);
+			printf("nat port blocks per host: %d\n", max_blocks);
+			break;
 		} /* switch */
 	} /* -- while -- */
 
 	/* -- zero out sr instance -- */
 	sr_init_instance(&sr);
+	sr.icmp_limit.type_rate = icmp_type_rate;
+	sr.icmp_limit.source_rate = icmp_source_rate;
 
 	/* -- set up routing table from file -- */
 	if(template == NULL) {
@@ -196,20 +392,69 @@ int main(int argc, char **argv)
 		
 		(&sr)->nat = malloc(sizeof(struct sr_nat));
 		(&sr)->nat->icmp_timeout = icmp_mto;
+		(&sr)->nat->udp_timeout = udp_mto;
 		(&sr)->nat->tcp_establish_timeout = tcp_syn_mto;
 		(&sr)->nat->tcp_transitory_timeout = tcp_idle_mto;
+		(&sr)->nat->tcp_fin_timeout = tcp_fin_mto;
+		(&sr)->nat->tcp_closed_timeout = tcp_closed_mto;
 		(&sr)->nat->tcp_unsolicited_syn_timeout = tcp_unsolicited_syn_mto;
+		(&sr)->nat->pool_mappings = pool_mappings;
+		(&sr)->nat->pool_conns = pool_conns;
+		(&sr)->nat->mapping_mode = mapping_mode;
+		(&sr)->nat->filtering_mode = filtering_mode;
+		(&sr)->nat->limits = limits;
+		(&sr)->nat->static_file = static_file;
+		(&sr)->nat->frag_mode = frag_mode;
+		(&sr)->nat->block_size = block_size;
+		(&sr)->nat->max_blocks = max_blocks;
+		(&sr)->nat->ext_count = 0;
+		if (ext_pool) {
+			sr_parse_nat_pool((&sr)->nat, ext_pool);
+		}
+		(&sr)->nat->det_count = 0;
+		for (c = 0; c < det_count; c++) {
+			sr_parse_nat_det((&sr)->nat, det_rules[c]);
+		}
 	}
 	/* call router init (for arp subsystem etc.) */
 	
 	sr_init(&sr);
-	if (sr_read_from_server(&sr) == 1){ if (nat ) {sr_enable_NAT(&sr,nat);}}
+	/* kill -USR1 prints the statistics */
+	signal(SIGUSR1, sr_stats_request);
+	sr_arpcache_set_timeout(&(sr.cache), arp_timeout);
+	if (sr_read_from_server(&sr) == 1){
+		/* The interfaces exist once the server's HWINFO has been read */
+		for (c = 0; c < if_mtu_count; c++) {
+			sr_parse_if_mtu(&sr, if_mtus[c]);
+		}
+		for (c = 0; c < if_mss_count; c++) {
+			sr_parse_if_mss(&sr, if_mss[c]);
+		}
+		if (acl_file && sr_acl_load(&sr, acl_file)) {
+			exit(1);
+		}
+		for (c = 0; c < if_rate_count; c++) {
+			sr_parse_if_rate(&sr, if_rates[c]);
+		}
+		sr_sched_start(&sr);
+		if (nat ) {sr_enable_NAT(&sr,nat);}
+	}
 	/* -- whizbang main loop ;-) */
 	while( sr_read_from_server(&sr) == 1);
 	/* If nat is enabled, destory the instance*/
 	if ((&sr)->nat_enable) {
+		sr_nat_dump_pools((&sr)->nat);
 		sr_nat_destroy((&sr)->nat);
 	}
+	sr_acl_dump(&sr);
+	sr_icmp_limit_dump(&sr);
+	sr_stats_dump(&sr);
+	struct sr_if* if_walker;
+	for (if_walker = sr.if_list; if_walker; if_walker = if_walker->next) {
+		if (if_walker->sched) {
+			sr_sched_dump(if_walker->sched, if_walker->name);
+		}
+	}
 	sr_destroy_instance(&sr);
 	return 0;
 }/* -- main -- */
@@ -225,11 +470,174 @@ static void usage(char* argv0)
 	printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
 	printf("           [-T template_name] [-u username] \n");
 	printf("           [-t topo id] [-r routing table] \n");
-	printf("           [-l log file] \n");
+	printf("           [-l log file] [-A arp cache timeout] \n");
+	printf("           [-M nat mapping pool] [-C nat connection pool] \n");
+	printf("           [-m nat mapping ei|ad|apd] [-f nat filtering ei|ad|apd] \n");
+	printf("           [-P nat address pool ip,ip,...] \n");
+	printf("           [-B nat port block size] [-K nat blocks per host] \n");
+	printf("           [-D deterministic nat prefix/len,first ext ip,ext ip count] \n");
+	printf("           [-q nat mappings per host] [-c nat connections per host] \n");
+	printf("           [-y nat pending syns per host] [-Q nat mappings] \n");
+	printf("           [-L nat connections] [-Y nat pending syns] \n");
+	printf("           [-S nat port forwarding rules] \n");
+	printf("           [-V nat reassembles fragments instead of virtual reassembly] \n");
+	printf("           [-O interface:mtu] [-X nat mss clamp interface[:mss]] \n");
+	printf("           [-a packet filter rules] \n");
+	printf("           [-b interface:kbit/s[:burst bytes]] \n");
+	printf("           [-i icmp per type per second] [-j icmp per destination per second] \n");
 	printf("   defaults server=%s port=%d host=%s  \n",
 			DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_nat_behavior(..)
+ * Scope: local
+ *
+ * Endpoint independent (ei), address dependent (ad) or address and port
+ * dependent (apd), as in RFC 4787.
+ *---------------------------------------------------------------------------*/
+
+static sr_nat_behavior sr_parse_nat_behavior(char* name)
+{
+	if (strcmp(name, "ei") == 0) {
+		return nat_endpoint_independent;
+	} else if (strcmp(name, "ad") == 0) {
+		return nat_address_dependent;
+	} else if (strcmp(name, "apd") == 0) {
+		return nat_address_port_dependent;
+	}
+	fprintf(stderr, "Unknown NAT behavior %s\n", name);
+	usage("sr");
+	exit(1);
+} /* -- sr_parse_nat_behavior -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_nat_pool(..)
+ * Scope: local
+ *
+ * Comma separated external addresses for the NAT, used instead of the
+ * external interface's address.
+ *---------------------------------------------------------------------------*/
+
+static void sr_parse_nat_pool(struct sr_nat* nat, char* list)
+{
+	struct in_addr addr;
+	char* ip = strtok(list, ",");
+	while (ip) {
+		if (inet_aton(ip, &addr) == 0) {
+			fprintf(stderr, "Bad NAT pool address %s\n", ip);
+			exit(1);
+		}
+		if (sr_nat_add_address(nat, addr.s_addr)) {
+			fprintf(stderr, "NAT pool holds at most %d addresses\n", SR_NAT_MAX_ADDRS);
+			exit(1);
+		}
+		ip = strtok(NULL, ",");
+	}
+} /* -- sr_parse_nat_pool -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_nat_det(..)
+ * Scope: local
+ *
+ * prefix/len,first external ip,external ip count: translate the internal
+ * prefix deterministically onto that many consecutive external addresses,
+ * which must not be in the -P pool.
+ *---------------------------------------------------------------------------*/
+
+static void sr_parse_nat_det(struct sr_nat* nat, char* rule)
+{
+	struct in_addr net, ext;
+	char* prefix = strtok(rule, "/");
+	char* len = strtok(NULL, ",");
+	char* first = strtok(NULL, ",");
+	char* count = strtok(NULL, ",");
+
+	if (!prefix || !len || !first || !count ||
+	    inet_aton(prefix, &net) == 0 || inet_aton(first, &ext) == 0) {
+		fprintf(stderr, "Bad deterministic NAT rule\n");
+		exit(1);
+	}
+	if (sr_nat_add_det(nat, net.s_addr, atoi(len), ext.s_addr, atoi(count))) {
+		fprintf(stderr, "Deterministic NAT prefix %s/%s does not fit\n", prefix, len);
+		exit(1);
+	}
+} /* -- sr_parse_nat_det -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_if_mtu(..)
+ * Scope: local
+ *
+ * interface:mtu, the IP MTU of one of the router's interfaces. Packets
+ * forwarded out of it are fragmented to fit.
+ *---------------------------------------------------------------------------*/
+
+static void sr_parse_if_mtu(struct sr_instance* sr, char* setting)
+{
+	char* name = strtok(setting, ":");
+	char* mtu = strtok(NULL, ":");
+	long value = mtu ? atol(mtu) : 0;
+
+	if (!name || value <= 0 || value > 0xffff ||
+	    sr_set_interface_mtu(sr, name, value)) {
+		fprintf(stderr, "Bad interface MTU %s\n", setting);
+		exit(1);
+	}
+} /* -- sr_parse_if_mtu -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_if_mss(..)
+ * Scope: local
+ *
+ * interface[:mss], clamp the MSS of TCP SYNs the NAT sends out of the
+ * interface to what fits its MTU, and to mss if given.
+ *---------------------------------------------------------------------------*/
+
+static void sr_parse_if_mss(struct sr_instance* sr, char* setting)
+{
+	char* name = strtok(setting, ":");
+	char* mss = strtok(NULL, ":");
+	int value = mss ? atoi(mss) : SR_IF_MSS_MTU;
+
+	if (!name || value <= 0 || value > SR_IF_MSS_MTU ||
+	    sr_set_interface_mss(sr, name, value)) {
+		fprintf(stderr, "Bad interface MSS clamp %s\n", setting);
+		exit(1);
+	}
+} /* -- sr_parse_if_mss -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_if_rate(..)
+ * Scope: local
+ *
+ * interface:kbit[:burst], shape packets forwarded out of the interface to
+ * kbit kilobits a second in bursts of up to burst bytes, by default 20ms
+ * worth and at least two full frames.
+ *---------------------------------------------------------------------------*/
+
+static void sr_parse_if_rate(struct sr_instance* sr, char* setting)
+{
+	char* name = strtok(setting, ":");
+	char* kbit = strtok(NULL, ":");
+	char* burst = strtok(NULL, ":");
+	long rate = kbit ? atol(kbit) : 0;
+	long bytes;
+
+	if (rate <= 0 || rate > 32000000) {
+		fprintf(stderr, "Bad interface rate %s\n", setting);
+		exit(1);
+	}
+	rate = rate * 1000 / 8;
+	bytes = burst ? atol(burst) : rate / 50;
+	if (!burst && bytes < 2 * (SR_IF_DEFAULT_MTU + sizeof(sr_ethernet_hdr_t))) {
+		bytes = 2 * (SR_IF_DEFAULT_MTU + sizeof(sr_ethernet_hdr_t));
+	}
+	if (!name || bytes <= 0 || sr_set_interface_rate(sr, name, rate, bytes)) {
+		fprintf(stderr, "Bad interface rate %s\n", setting);
+		exit(1);
+	}
+} /* -- sr_parse_if_rate -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_set_user(..)
  * Scope: local
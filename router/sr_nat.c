@@ -5,17 +5,678 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#define __USE_MISC 1 /* force linux to show inet_aton */
+#include <arpa/inet.h>
 #include "sr_router.h"
+#include "sr_stats.h"
 
+/* Smallest number of buckets in each mapping table */
+#define SR_NAT_MIN_BUCKETS 256
 
+/* Spread every bit of x over all of the result (MurmurHash3's finalizer).
+   Addresses and ports in network order differ mostly in their high bits,
+   which a multiply alone only carries further up. */
+static uint32_t sr_nat_mix(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x85ebca6b;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35;
+  return x ^ (x >> 16);
+}
+
+/* The address is mixed before the port joins it, so no change to one can
+   cancel a change to the other */
+static uint32_t sr_nat_hash(uint32_t ip, uint16_t aux, uint8_t type) {
+  return sr_nat_mix(sr_nat_mix(ip) ^ aux ^ ((uint32_t)type << 16));
+}
+
+#define sr_nat_int_bucket(nat, ip, aux, type, rip, rport) \
+  (&(nat)->int_table[(sr_nat_hash((ip), (aux), (type)) ^ \
+                      sr_nat_hash((rip), (rport), 0)) & (nat)->table_mask])
+#define sr_nat_ext_bucket(nat, ip, aux, type) \
+  (&(nat)->ext_table[sr_nat_hash((ip), (aux), (type)) & (nat)->table_mask])
+#define sr_nat_conn_bucket(nat, mapping, ip, port) \
+  (&(nat)->conn_table[sr_nat_hash((ip) ^ (uint32_t)((size_t)(mapping) >> 6), \
+                                  (port), 0) & (nat)->conn_mask])
+
+/* Mask the remote endpoint down to the part the mapping or filtering
+   behaviour keys on */
+#define sr_nat_key_ip(mode, ip) \
+  ((mode) == nat_endpoint_independent ? 0 : (ip))
+#define sr_nat_key_port(mode, port) \
+  ((mode) == nat_address_port_dependent ? (port) : 0)
+
+/* Find the mapping for an internal (ip, port) pair and the remote part of
+   the key, already masked. Call with the lock held. */
+static struct sr_nat_mapping *sr_nat_find_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, uint8_t type, uint32_t ip_remote, uint16_t port_remote) {
+  struct sr_nat_mapping *cur = *sr_nat_int_bucket(nat, ip_int, aux_int, type, ip_remote, port_remote);
+  while(cur){
+	  if((cur->type == type) && (cur->ip_int == ip_int) && (cur->aux_int == aux_int)
+	     && (cur->ip_remote == ip_remote) && (cur->port_remote == port_remote)){
+		  return cur;
+	  }
+	  cur = cur->next_int;
+  }
+  return NULL;
+}
+
+/* Find the table entry of a mapping copy. Call with the lock held. */
+#define sr_nat_find_copy(nat, copy) \
+  sr_nat_find_internal((nat), (copy)->ip_int, (copy)->aux_int, (copy)->type, \
+                       (copy)->ip_remote, (copy)->port_remote)
+
+/* Deterministic rule whose internal prefix holds ip_int */
+static struct sr_nat_det *sr_nat_det_internal(struct sr_nat *nat, uint32_t ip_int) {
+  unsigned int i;
+  for (i = 0; i < nat->det_count; i++) {
+	  if (ntohl(ip_int) - nat->det[i].int_net < nat->det[i].int_hosts) {
+		  return &(nat->det[i]);
+	  }
+  }
+  return NULL;
+}
+
+/* Deterministic rule whose external addresses hold ip_ext */
+static struct sr_nat_det *sr_nat_det_external(struct sr_nat *nat, uint32_t ip_ext) {
+  unsigned int i;
+  for (i = 0; i < nat->det_count; i++) {
+	  if (ntohl(ip_ext) - nat->det[i].ext_first < nat->det[i].ext_count) {
+		  return &(nat->det[i]);
+	  }
+  }
+  return NULL;
+}
+
+/* Mapping on a deterministic external (ip, port), found by computing the
+   internal host and indexing its block. */
+static struct sr_nat_mapping *sr_nat_det_find(struct sr_nat_det *det,
+  uint32_t ip_ext, uint16_t aux_ext, uint8_t type) {
+  if (aux_ext < SR_NAT_PORT_MIN) {
+	  return NULL;
+  }
+  uint32_t slot = (aux_ext - SR_NAT_PORT_MIN) / det->ports_per_host;
+  if (slot >= det->hosts_per_addr) {
+	  return NULL;
+  }
+  uint32_t k = (ntohl(ip_ext) - det->ext_first) * det->hosts_per_addr + slot;
+  if (k >= det->int_hosts || det->hosts[k] == NULL) {
+	  return NULL;
+  }
+  struct sr_nat_block *block = det->hosts[k];
+  return block->slots[type * block->size + aux_ext - block->base];
+}
+
+/* Find the mapping for an external (ip, port) pair. Call with the lock
+   held. */
+static struct sr_nat_mapping *sr_nat_find_external(struct sr_nat *nat,
+  uint32_t ip_ext, uint16_t aux_ext, uint8_t type) {
+  if (nat->static_table[type] && ip_ext == nat->static_ip && nat->static_table[type][aux_ext]) {
+	  return nat->static_table[type][aux_ext];
+  }
+  struct sr_nat_det *det = sr_nat_det_external(nat, ip_ext);
+  if (det) {
+	  return sr_nat_det_find(det, ip_ext, aux_ext, type);
+  }
+  struct sr_nat_mapping *cur = *sr_nat_ext_bucket(nat, ip_ext, aux_ext, type);
+  while(cur){
+	  if(cur->type == type && cur->aux_ext == aux_ext && cur->ip_ext == ip_ext){
+		  return cur;
+	  }
+	  cur = cur->next_ext;
+  }
+  return NULL;
+}
+
+/* Find the connection of a mapping with the given remote endpoint. Call
+   with the lock held. */
+static struct sr_nat_connection *sr_nat_find_connection(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_remote, uint16_t port_remote) {
+  struct sr_nat_connection *con = *sr_nat_conn_bucket(nat, mapping, ip_remote, port_remote);
+  while (con){
+	  if (con->mapping == mapping && con->ip_remote == ip_remote && con->port_remote == port_remote){
+		  return con;
+	  }
+	  con = con->next_hash;
+  }
+  return NULL;
+}
+
+/* Unlink a mapping from both lookup tables. Call with the lock held. */
+static void sr_nat_unhash(struct sr_nat *nat, struct sr_nat_mapping *mapping) {
+  struct sr_nat_mapping **pp = sr_nat_int_bucket(nat, mapping->ip_int, mapping->aux_int, mapping->type,
+                                                  mapping->ip_remote, mapping->port_remote);
+  while (*pp != mapping) {
+	  pp = &(*pp)->next_int;
+  }
+  *pp = mapping->next_int;
+
+  if (mapping->block && mapping->block->det) {
+	  return;
+  }
+  pp = sr_nat_ext_bucket(nat, mapping->ip_ext, mapping->aux_ext, mapping->type);
+  while (*pp != mapping) {
+	  pp = &(*pp)->next_ext;
+  }
+  *pp = mapping->next_ext;
+}
+
+#define sr_nat_host_bucket(nat, ip) \
+  (&(nat)->host_table[sr_nat_hash((ip), 0, 1) & (nat)->host_mask])
+
+/* Find the quota record of an internal host. Call with the lock held. */
+static struct sr_nat_host *sr_nat_find_host(struct sr_nat *nat, uint32_t ip_int) {
+  struct sr_nat_host *host = *sr_nat_host_bucket(nat, ip_int);
+  while (host && host->ip_int != ip_int) {
+	  host = host->next;
+  }
+  return host;
+}
+
+/* Find or create the quota record of an internal host. Call with the
+   lock held. */
+static struct sr_nat_host *sr_nat_get_host(struct sr_nat *nat, uint32_t ip_int) {
+  struct sr_nat_host *host = sr_nat_find_host(nat, ip_int);
+  if (host == NULL) {
+	  host = (struct sr_nat_host *)sr_slab_alloc(&(nat->host_pool));
+	  if (host == NULL) {
+		  return NULL;
+	  }
+	  memset(host, 0, sizeof(struct sr_nat_host));
+	  host->ip_int = ip_int;
+	  struct sr_nat_host **bucket = sr_nat_host_bucket(nat, ip_int);
+	  host->next = *bucket;
+	  *bucket = host;
+  }
+  return host;
+}
+
+/* Release the quota record of a host once it holds nothing. Call with the
+   lock held. */
+static void sr_nat_put_host(struct sr_nat *nat, struct sr_nat_host *host) {
+  if (host->mappings || host->conns || host->pending) {
+	  return;
+  }
+  struct sr_nat_host **pp = sr_nat_host_bucket(nat, host->ip_int);
+  while (*pp != host) {
+	  pp = &(*pp)->next;
+  }
+  *pp = host->next;
+  sr_slab_free(&(nat->host_pool), host);
+}
+
+/* Hold on to an unanswered inbound SYN of con, within the pending SYN
+   limits. Returns -1 if either refuses it. Call with the lock held. */
+static int sr_nat_cold_alloc(struct sr_nat *nat, struct sr_nat_connection *con) {
+  struct sr_nat_host *host = sr_nat_find_host(nat, con->mapping->ip_int);
+  if (host->pending >= nat->limits.host_pending) {
+	  nat->drops.host_pending++;
+	  host->drops++;
+	  return -1;
+  }
+  if (nat->cold_pool.in_use >= nat->limits.pending) {
+	  nat->drops.pending++;
+	  host->drops++;
+	  return -1;
+  }
+  con->cold = (struct sr_nat_conn_cold *)sr_slab_alloc(&(nat->cold_pool));
+  if (con->cold == NULL) {
+	  return -1;
+  }
+  host->pending++;
+  return 0;
+}
+
+/* Let go of the held SYN of con, if any. Call with the lock held. */
+static void sr_nat_cold_free(struct sr_nat *nat, struct sr_nat_connection *con) {
+  if (con->cold == NULL) {
+	  return;
+  }
+  struct sr_nat_host *host = sr_nat_find_host(nat, con->mapping->ip_int);
+  host->pending--;
+  sr_slab_free(&(nat->cold_pool), con->cold);
+  con->cold = NULL;
+}
+
+/* Unlink a connection from the connection table and release it and its
+   cold state. Call with the lock held. */
+static void sr_nat_free_connection(struct sr_nat *nat, struct sr_nat_connection *con) {
+  struct sr_nat_connection **pp = sr_nat_conn_bucket(nat, con->mapping, con->ip_remote, con->port_remote);
+  while (*pp != con) {
+	  pp = &(*pp)->next_hash;
+  }
+  *pp = con->next_hash;
+
+  sr_nat_cold_free(nat, con);
+  struct sr_nat_host *host = sr_nat_find_host(nat, con->mapping->ip_int);
+  host->conns--;
+  sr_nat_put_host(nat, host);
+  sr_slab_free(&(nat->conn_pool), con);
+}
+
+static struct sr_nat_connection *sr_nat_new_connection(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_remote, uint16_t port_remote);
+
+/* Record that the internal host of mapping sent to the remote endpoint, so
+   the filter lets replies in. Call with the lock held. */
+static void sr_nat_permit(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  uint32_t ip_remote, uint16_t port_remote) {
+  if (nat->filtering_mode == nat_endpoint_independent) {
+	  return;
+  }
+  ip_remote = sr_nat_key_ip(nat->filtering_mode, ip_remote);
+  port_remote = sr_nat_key_port(nat->filtering_mode, port_remote);
+
+  struct sr_nat_connection *con = sr_nat_find_connection(nat, mapping, ip_remote, port_remote);
+  if (con == NULL) {
+	  con = sr_nat_new_connection(nat, mapping, ip_remote, port_remote);
+	  if (con == NULL) {
+		  return;
+	  }
+	  /* Closed, so a SYN to the same endpoint opens it as a connection */
+	  con->state = tcp_state_closed;
+	  con->flags = SR_NAT_CONN_PERMIT;
+  }
+  con->last_updated = nat->ticks;
+}
+
+/* Check whether the filter lets a packet from the remote endpoint into
+   mapping. Call with the lock held. */
+static int sr_nat_filter(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  uint32_t ip_remote, uint16_t port_remote) {
+  if (nat->filtering_mode == nat_endpoint_independent || (mapping->flags & SR_NAT_MAPPING_STATIC)) {
+	  return 1;
+  }
+  return sr_nat_find_connection(nat, mapping,
+                                sr_nat_key_ip(nat->filtering_mode, ip_remote),
+                                sr_nat_key_port(nat->filtering_mode, port_remote)) != NULL;
+}
+
+/* Idle timeout of a mapping without connections */
+static uint16_t sr_nat_mapping_timeout(struct sr_nat *nat, uint8_t type) {
+  switch (type){
+	  case nat_mapping_icmp:
+		  return nat->icmp_timeout;
+	  case nat_mapping_udp:
+		  return nat->udp_timeout;
+	  /* TCP mappings are kept alive by their connections */
+	  case nat_mapping_tcp:
+	  default:
+		  return 5;
+  }
+}
+
+/* External address of an internal host. Paired pooling: hashing the
+   host's address gives every mapping of one host the same address, and
+   spreads the hosts over the pool. */
+static struct sr_nat_addr *sr_nat_pair_address(struct sr_nat *nat, uint32_t ip_int) {
+  return &(nat->ext_addrs[sr_nat_hash(ip_int, 0, 0) % nat->ext_count]);
+}
+
+/* Pick a free external port or ICMP id on addr, or -1 if all are taken.
+   Call with the lock held. */
+static int sr_nat_alloc_port(struct sr_nat *nat, struct sr_nat_addr *addr, uint8_t type) {
+  unsigned int tries;
+  for (tries = 0; tries < SR_NAT_PORT_MAX - SR_NAT_PORT_MIN + 1; tries++) {
+	  uint16_t port = addr->next_port;
+	  addr->next_port = (port == SR_NAT_PORT_MAX) ? SR_NAT_PORT_MIN : port + 1;
+	  if (sr_nat_find_external(nat, addr->ip, port, type) == NULL) {
+		  return port;
+	  }
+  }
+  return -1;
+}
+
+/* Port ranges of one block each address is cut into */
+#define sr_nat_blocks_per_addr(nat) \
+  ((SR_NAT_PORT_MAX - SR_NAT_PORT_MIN + 1) / (nat)->block_size)
+
+#define sr_nat_block_bucket(nat, ip) \
+  (&(nat)->block_table[sr_nat_hash((ip), 0, 0) & (nat)->block_mask])
+
+/* Take a free port of the given type from block, or -1 if it has none.
+   Call with the lock held. */
+static int sr_nat_block_take(struct sr_nat *nat, struct sr_nat_block *block, uint8_t type) {
+  if (block->used[type] == block->size) {
+	  return -1;
+  }
+  uint16_t i;
+  for (i = 0; i < block->size; i++) {
+	  uint16_t port = block->base + block->cursor;
+	  block->cursor = (block->cursor + 1 == block->size) ? 0 : block->cursor + 1;
+	  if (sr_nat_find_external(nat, block->ip_ext, port, type) == NULL) {
+		  return port;
+	  }
+  }
+  return -1;
+}
+
+/* Pick a port for a new mapping of ip_int from the host's blocks on addr,
+   taking another block from addr when they are full. Returns -1 if none
+   is left or the host already holds max_blocks. Call with the lock held. */
+static int sr_nat_block_port(struct sr_nat *nat, uint32_t ip_int,
+  struct sr_nat_addr *addr, uint8_t type, struct sr_nat_block **blockp) {
+  struct sr_nat_block **bucket = sr_nat_block_bucket(nat, ip_int);
+  struct sr_nat_block *block;
+  unsigned int held = 0;
+  int port;
+
+  for (block = *bucket; block; block = block->next) {
+	  if (block->ip_int != ip_int) {
+		  continue;
+	  }
+	  held++;
+	  port = sr_nat_block_take(nat, block, type);
+	  if (port >= 0) {
+		  *blockp = block;
+		  return port;
+	  }
+  }
+
+  if (held >= nat->max_blocks || addr->free_count == 0) {
+	  return -1;
+  }
+  block = (struct sr_nat_block *)sr_slab_alloc(&(nat->block_pool));
+  if (block == NULL) {
+	  return -1;
+  }
+  block->ip_int = ip_int;
+  block->ip_ext = addr->ip;
+  block->addr = addr;
+  block->det = NULL;
+  block->base = addr->free_blocks[--addr->free_count];
+  block->size = nat->block_size;
+  block->slots = NULL;
+  block->cursor = 0;
+  memset(block->used, 0, sizeof(block->used));
+  block->next = *bucket;
+  *bucket = block;
+
+  *blockp = block;
+  return sr_nat_block_take(nat, block, type);
+}
+
+/* Pick a port for a new mapping of ip_int from its deterministic block,
+   setting the block up on the host's first mapping. Call with the lock
+   held. */
+static int sr_nat_det_port(struct sr_nat *nat, struct sr_nat_det *det,
+  uint32_t ip_int, uint8_t type, struct sr_nat_block **blockp) {
+  uint32_t k = ntohl(ip_int) - det->int_net;
+  struct sr_nat_block *block = det->hosts[k];
+
+  if (block == NULL) {
+	  block = (struct sr_nat_block *)sr_slab_alloc(&(nat->block_pool));
+	  if (block == NULL) {
+		  return -1;
+	  }
+	  block->slots = (struct sr_nat_mapping **)calloc(nat_mapping_type_count * det->ports_per_host,
+	                                                  sizeof(struct sr_nat_mapping *));
+	  if (block->slots == NULL) {
+		  sr_slab_free(&(nat->block_pool), block);
+		  return -1;
+	  }
+	  block->ip_int = ip_int;
+	  block->ip_ext = htonl(det->ext_first + k / det->hosts_per_addr);
+	  block->addr = NULL;
+	  block->det = det;
+	  block->base = SR_NAT_PORT_MIN + (k % det->hosts_per_addr) * det->ports_per_host;
+	  block->size = det->ports_per_host;
+	  block->cursor = 0;
+	  memset(block->used, 0, sizeof(block->used));
+	  block->next = NULL;
+	  det->hosts[k] = block;
+  }
+
+  *blockp = block;
+  return sr_nat_block_take(nat, block, type);
+}
+
+/* Give back the external port of a mapping being freed, and its block
+   once that was the block's last mapping. Call with the lock held. */
+static void sr_nat_release_port(struct sr_nat *nat, struct sr_nat_mapping *mapping) {
+  struct sr_nat_block *block = mapping->block;
+  if (block == NULL) {
+	  return;
+  }
+  block->used[mapping->type]--;
+  if (block->slots) {
+	  block->slots[mapping->type * block->size + mapping->aux_ext - block->base] = NULL;
+  }
+
+  int type;
+  for (type = 0; type < nat_mapping_type_count; type++) {
+	  if (block->used[type]) {
+		  return;
+	  }
+  }
+
+  if (block->det) {
+	  block->det->hosts[ntohl(block->ip_int) - block->det->int_net] = NULL;
+	  free(block->slots);
+  } else {
+	  struct sr_nat_block **pp = sr_nat_block_bucket(nat, block->ip_int);
+	  while (*pp != block) {
+		  pp = &(*pp)->next;
+	  }
+	  *pp = block->next;
+	  block->addr->free_blocks[block->addr->free_count++] = block->base;
+  }
+  sr_slab_free(&(nat->block_pool), block);
+}
+
+int sr_nat_add_address(struct sr_nat *nat, uint32_t ip) {
+  if (nat->ext_count == SR_NAT_MAX_ADDRS) {
+	  return -1;
+  }
+  struct sr_nat_addr *addr = &(nat->ext_addrs[nat->ext_count]);
+  addr->ip = ip;
+  addr->next_port = SR_NAT_PORT_MIN;
+  addr->free_blocks = NULL;
+  addr->free_count = 0;
+
+  if (nat->block_size) {
+	  /* Stacked so the lowest block is handed out first */
+	  unsigned int count = sr_nat_blocks_per_addr(nat);
+	  addr->free_blocks = (uint16_t *)malloc(count * sizeof(uint16_t));
+	  while (addr->free_count < count) {
+		  addr->free_blocks[addr->free_count] =
+		    SR_NAT_PORT_MIN + (count - 1 - addr->free_count) * nat->block_size;
+		  addr->free_count++;
+	  }
+  }
+  nat->ext_count++;
+  return 0;
+}
+
+int sr_nat_add_det(struct sr_nat *nat, uint32_t net, unsigned int len,
+  uint32_t ext_first, unsigned int count) {
+  if (nat->det_count == SR_NAT_MAX_DET || len < SR_NAT_DET_MIN_LEN || len > 32 || count == 0) {
+	  return -1;
+  }
+  struct sr_nat_det *det = &(nat->det[nat->det_count]);
+  det->int_hosts = 1U << (32 - len);
+  det->int_net = ntohl(net) & ~(det->int_hosts - 1);
+  det->ext_first = ntohl(ext_first);
+  det->ext_count = count;
+  det->hosts_per_addr = (det->int_hosts + count - 1) / count;
+  if (det->hosts_per_addr > SR_NAT_PORT_MAX - SR_NAT_PORT_MIN + 1) {
+	  return -1;
+  }
+  det->ports_per_host = (SR_NAT_PORT_MAX - SR_NAT_PORT_MIN + 1) / det->hosts_per_addr;
+  det->hosts = (struct sr_nat_block **)calloc(det->int_hosts, sizeof(struct sr_nat_block *));
+  nat->det_count++;
+  return 0;
+}
+
+/* Add the permanent mapping of one forwarded port. Call with the lock
+   held. */
+static int sr_nat_add_static(struct sr_nat *nat, uint8_t type, uint16_t port_ext,
+  uint32_t ip_int, uint16_t port_int) {
+  if (nat->static_table[type] == NULL) {
+	  nat->static_table[type] = (struct sr_nat_mapping **)calloc(65536, sizeof(struct sr_nat_mapping *));
+	  if (nat->static_table[type] == NULL) {
+		  return -1;
+	  }
+  }
+  if (nat->static_table[type][port_ext]) {
+	  return -1;
+  }
+  struct sr_nat_host *host = sr_nat_get_host(nat, ip_int);
+  struct sr_nat_mapping *new = (struct sr_nat_mapping *)sr_slab_alloc(&(nat->mapping_pool));
+  if (host == NULL || new == NULL) {
+	  if (host) {
+		  sr_nat_put_host(nat, host);
+	  }
+	  if (new) {
+		  sr_slab_free(&(nat->mapping_pool), new);
+	  }
+	  return -1;
+  }
+  host->mappings++;
+  memset(new, 0, sizeof(struct sr_nat_mapping));
+  new->type = type;
+  new->flags = SR_NAT_MAPPING_STATIC;
+  new->ip_int = ip_int;
+  new->ip_ext = nat->static_ip;
+  new->aux_int = htons(port_int);
+  new->aux_ext = port_ext;
+  new->last_updated = nat->ticks;
+
+  new->next = nat->mappings;
+  nat->mappings = new;
+  struct sr_nat_mapping **bucket = sr_nat_int_bucket(nat, ip_int, new->aux_int, type, 0, 0);
+  new->next_int = *bucket;
+  *bucket = new;
+  nat->static_table[type][port_ext] = new;
+  return 0;
+}
+
+int sr_nat_load_static(struct sr_nat *nat, const char *filename) {
+  FILE* fp;
+  char  line[BUFSIZ];
+  char  proto[32];
+  char  ports[32];
+  char  ip[32];
+  unsigned int port_int;
+  unsigned int first, last;
+  int fields;
+  struct in_addr ip_addr;
+  uint8_t type;
+  int result = 0;
+
+  fp = fopen(filename, "r");
+  if (fp == NULL) {
+	  perror("fopen");
+	  return -1;
+  }
+
+  pthread_mutex_lock(&(nat->lock));
+  nat->static_ip = nat->ext_addrs[0].ip;
+  while (result == 0 && fgets(line, BUFSIZ, fp) != 0) {
+	  if (line[0] == '#' || sscanf(line, "%31s %31s %31s %u", proto, ports, ip, &port_int) != 4) {
+		  continue;
+	  }
+	  if (strcmp(proto, "tcp") == 0) {
+		  type = nat_mapping_tcp;
+	  } else if (strcmp(proto, "udp") == 0) {
+		  type = nat_mapping_udp;
+	  } else {
+		  fprintf(stderr, "Error loading NAT rules, unknown protocol %s\n", proto);
+		  result = -1;
+		  break;
+	  }
+	  fields = sscanf(ports, "%u-%u", &first, &last);
+	  if (fields == 1) {
+		  last = first;
+	  }
+	  if (fields < 1 || inet_aton(ip, &ip_addr) == 0 || first == 0 || first > last || last > 65535 ||
+	      port_int == 0 || port_int + (last - first) > 65535) {
+		  fprintf(stderr, "Error loading NAT rules, bad rule %s %s %s %u\n", proto, ports, ip, port_int);
+		  result = -1;
+		  break;
+	  }
+	  for (; first <= last && result == 0; first++, port_int++) {
+		  if (sr_nat_add_static(nat, type, first, ip_addr.s_addr, port_int)) {
+			  fprintf(stderr, "Error loading NAT rules, %s port %u forwarded twice\n", proto, first);
+			  result = -1;
+		  }
+	  }
+  }
+  pthread_mutex_unlock(&(nat->lock));
+  fclose(fp);
+  return result;
+}
+
+int sr_nat_is_external(struct sr_nat *nat, uint32_t ip) {
+  if (sr_nat_det_external(nat, ip)) {
+	  return 1;
+  }
+  unsigned int i;
+  for (i = 0; i < nat->ext_count; i++) {
+	  if (nat->ext_addrs[i].ip == ip) {
+		  return 1;
+	  }
+  }
+  return 0;
+}
 
 int sr_nat_init(struct sr_instance *sr) { /* Initializes the nat */
-	
+
 	struct sr_nat* nat = sr->nat;
   assert(nat);
-  
+
   nat->mappings = NULL;
-  nat->global_auxext = 1024;  
+  nat->epoch = time(NULL);
+  nat->ticks = 0;
+
+  /* Handshakes use the transitory timeout; once a FIN or RST has been
+     seen the connection only needs to outlive stray segments */
+  nat->tcp_timeouts[tcp_state_syn_sent] = nat->tcp_transitory_timeout;
+  nat->tcp_timeouts[tcp_state_syn_recv] = nat->tcp_transitory_timeout;
+  nat->tcp_timeouts[tcp_state_established] = nat->tcp_establish_timeout;
+  nat->tcp_timeouts[tcp_state_fin_wait] = nat->tcp_fin_timeout;
+  nat->tcp_timeouts[tcp_state_close_wait] = nat->tcp_fin_timeout;
+  nat->tcp_timeouts[tcp_state_time_wait] = nat->tcp_closed_timeout;
+  nat->tcp_timeouts[tcp_state_closed] = nat->tcp_closed_timeout;
+
+  sr_slab_init(&(nat->mapping_pool), "NAT mapping",
+               sizeof(struct sr_nat_mapping), SR_NAT_CACHE_LINE, nat->pool_mappings);
+  sr_slab_init(&(nat->conn_pool), "NAT connection",
+               sizeof(struct sr_nat_connection), SR_NAT_CACHE_LINE, nat->pool_conns);
+  sr_slab_init(&(nat->cold_pool), "NAT connection setup",
+               sizeof(struct sr_nat_conn_cold), 0, nat->limits.pending);
+  sr_slab_init(&(nat->block_pool), "NAT port block",
+               sizeof(struct sr_nat_block), 0, 0);
+  sr_slab_init(&(nat->host_pool), "NAT host",
+               sizeof(struct sr_nat_host), 0, 0);
+  sr_frag_init(&(nat->frags), nat->frag_mode, SR_FRAG_MAX_DATAGRAMS,
+               SR_FRAG_MAX_BYTES, SR_FRAG_TIMEOUT);
+
+  /* Size the lookup tables for the preallocated mappings */
+  uint32_t buckets = SR_NAT_MIN_BUCKETS;
+  while (buckets < nat->pool_mappings) {
+    buckets <<= 1;
+  }
+  nat->table_mask = buckets - 1;
+  nat->int_table = (struct sr_nat_mapping **)calloc(buckets, sizeof(struct sr_nat_mapping *));
+  nat->ext_table = (struct sr_nat_mapping **)calloc(buckets, sizeof(struct sr_nat_mapping *));
+
+  buckets = SR_NAT_MIN_BUCKETS;
+  while (buckets < nat->pool_conns) {
+    buckets <<= 1;
+  }
+  nat->conn_mask = buckets - 1;
+  nat->conn_table = (struct sr_nat_connection **)calloc(buckets, sizeof(struct sr_nat_connection *));
+
+  nat->host_mask = SR_NAT_MIN_BUCKETS - 1;
+  nat->host_table = (struct sr_nat_host **)calloc(SR_NAT_MIN_BUCKETS, sizeof(struct sr_nat_host *));
+  memset(&(nat->drops), 0, sizeof(nat->drops));
+  memset(nat->static_table, 0, sizeof(nat->static_table));
+
+  nat->block_mask = SR_NAT_MIN_BUCKETS - 1;
+  nat->block_table = (struct sr_nat_block **)calloc(SR_NAT_MIN_BUCKETS, sizeof(struct sr_nat_block *));
 
   /* Acquire mutex lock */
   pthread_mutexattr_init(&(nat->attr));
@@ -40,14 +701,36 @@ int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
   pthread_mutex_lock(&(nat->lock));
 
   /* free nat memory here */
-  
-  struct sr_nat_mapping *cur = nat->mappings;
-  struct sr_nat_mapping *cur_next;
-  while(cur){
-	  cur_next = cur->next;
-	  free(cur);
-	  cur = cur_next;
-}
+
+  /* Every mapping and connection lives in the pools */
+  nat->mappings = NULL;
+  free(nat->int_table);
+  free(nat->ext_table);
+  free(nat->conn_table);
+  free(nat->block_table);
+  free(nat->host_table);
+  unsigned int i;
+  for (i = 0; i < nat_mapping_type_count; i++) {
+    free(nat->static_table[i]);
+  }
+  for (i = 0; i < nat->ext_count; i++) {
+    free(nat->ext_addrs[i].free_blocks);
+  }
+  for (i = 0; i < nat->det_count; i++) {
+    uint32_t k;
+    for (k = 0; k < nat->det[i].int_hosts; k++) {
+      if (nat->det[i].hosts[k]) {
+        free(nat->det[i].hosts[k]->slots);
+      }
+    }
+    free(nat->det[i].hosts);
+  }
+  sr_slab_destroy(&(nat->mapping_pool));
+  sr_slab_destroy(&(nat->conn_pool));
+  sr_slab_destroy(&(nat->cold_pool));
+  sr_slab_destroy(&(nat->block_pool));
+  sr_slab_destroy(&(nat->host_pool));
+  sr_frag_destroy(&(nat->frags));
 
   pthread_kill(nat->thread, SIGKILL);
   return pthread_mutex_destroy(&(nat->lock)) &&
@@ -55,6 +738,22 @@ int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
 }
 
+void sr_nat_dump_pools(struct sr_nat *nat) {
+  pthread_mutex_lock(&(nat->lock));
+  sr_slab_dump(&(nat->mapping_pool));
+  sr_slab_dump(&(nat->conn_pool));
+  sr_slab_dump(&(nat->cold_pool));
+  sr_slab_dump(&(nat->block_pool));
+  sr_slab_dump(&(nat->host_pool));
+  sr_slab_dump(&(nat->frags.pool));
+  fprintf(stderr, "NAT drops: mappings %u/%u, connections %u/%u, pending SYNs %u/%u (host/global)\n",
+          nat->drops.host_mappings, nat->drops.mappings,
+          nat->drops.host_conns, nat->drops.conns,
+          nat->drops.host_pending, nat->drops.pending);
+  fprintf(stderr, "NAT fragment drops: %u\n", nat->frags.drops);
+  pthread_mutex_unlock(&(nat->lock));
+}
+
 void *sr_nat_timeout(void *sr_ptr) {  /* Periodic Timout handling */
 	struct sr_instance *sr = (struct sr_instance *)sr_ptr;
   struct sr_nat *nat = sr->nat;
@@ -63,7 +762,8 @@ void *sr_nat_timeout(void *sr_ptr) {  /* Periodic Timout handling */
     sleep(1.0);
     pthread_mutex_lock(&(nat->lock));
 
-    time_t curtime = time(NULL);
+    nat->ticks = (uint32_t)difftime(time(NULL), nat->epoch);
+    uint32_t curtime = nat->ticks;
 
     /* handle periodic tasks here */
       struct sr_nat_mapping* cur = nat->mappings;
@@ -71,113 +771,117 @@ void *sr_nat_timeout(void *sr_ptr) {  /* Periodic Timout handling */
       struct sr_nat_connection *con;
        struct sr_nat_connection *con_next;
 	nat->mappings = NULL;
-	
-	
+
+
+	sr_frag_expire(&(nat->frags), curtime);
+
 	while(cur){
 		cur_next = cur->next;
-		
-		switch (cur->type){
-			case nat_mapping_icmp:
-				timeout = nat->icmp_timeout;
-				break;
-			/* TODO: switch between establish and transitory*/
-			case nat_mapping_tcp:
-				timeout = 5;				
-				break;
-		}
-		
-		
-		if (cur->type == nat_mapping_tcp){
-			con = cur->conns;
-			cur->conns = NULL;
-			uint16_t con_timeout;
-			
-			while(con){
-				con_next = con->next;
-				
-				if (con->established == 1){
-					con_timeout = nat->tcp_establish_timeout;
-				}else if (con->established == 0){
-					con_timeout = nat->tcp_transitory_timeout;
-				}else {
-					con_timeout = nat->tcp_unsolicited_syn_timeout;
-				}
-				
-				double t = difftime(curtime, con->last_updated);
-				if(t < con_timeout){
-					con->next = cur->conns;
-					cur->conns = con;
-				} else {
-					if (con->established == -1) {
-						/* Call function to send ICMP */	
-						sr_sendICMPMsg(sr, 3, 3, nat->ext_iface->name, con->pending_packet, con->len);
-					}
-					free(con);
+
+		timeout = sr_nat_mapping_timeout(nat, cur->type);
+
+		con = cur->conns;
+		cur->conns = NULL;
+		uint16_t con_timeout;
+
+		while(con){
+			con_next = con->next;
+
+			if (con->flags & SR_NAT_CONN_PERMIT){
+				/* Let replies in for as long as the mapping would live */
+				con_timeout = (cur->type == nat_mapping_tcp) ? nat->tcp_transitory_timeout : timeout;
+			}else if (con->state == tcp_state_syn_sent && (con->flags & SR_NAT_CONN_INBOUND)){
+				con_timeout = nat->tcp_unsolicited_syn_timeout;
+			}else {
+				con_timeout = nat->tcp_timeouts[con->state];
+			}
+
+			if(curtime - con->last_updated < con_timeout){
+				con->next = cur->conns;
+				cur->conns = con;
+			} else {
+				if (con->state == tcp_state_syn_sent &&
+				    (con->flags & SR_NAT_CONN_INBOUND) && con->cold) {
+					/* Unsolicited SYN was never answered: send ICMP */
+					sr_sendICMPMsg(sr, 3, 3, nat->ext_iface->name, con->cold->pending_packet, con->cold->len);
 				}
-				con = con_next;
+				sr_nat_free_connection(nat, con);
 			}
+			con = con_next;
 		}
-		
-		double diff_time = difftime(curtime, cur->last_updated);
-		if(diff_time < timeout && cur->conns == NULL){
+
+		/* A mapping stays as long as it has live connections */
+		if(curtime - cur->last_updated < timeout || cur->conns != NULL ||
+		   (cur->flags & SR_NAT_MAPPING_STATIC)){
 			cur->next = nat->mappings;
 			nat->mappings = cur;
 		} else{
-			free(cur);
+			sr_nat_unhash(nat, cur);
+			sr_nat_release_port(nat, cur);
+			struct sr_nat_host *host = sr_nat_find_host(nat, cur->ip_int);
+			host->mappings--;
+			sr_nat_put_host(nat, host);
+			sr_slab_free(&(nat->mapping_pool), cur);
+			sr_stats_count(sr_stats_nat_expire);
 		}
 		cur = cur_next;
 	}
 
-	
-	
+
+
     pthread_mutex_unlock(&(nat->lock));
   }
   return NULL;
 }
 
-/* Get the mapping associated with given external port.
+/* Get the mapping associated with given external (ip, port), if its filtering
+   lets in a packet from (ip_remote, port_remote).
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) {
+    uint32_t ip_ext, uint16_t aux_ext, uint32_t ip_remote, uint16_t port_remote,
+    sr_nat_mapping_type type ) {
 
   pthread_mutex_lock(&(nat->lock));
 
   /* handle lookup here, malloc and assign to copy */
   struct sr_nat_mapping *copy = NULL;
-  
-  struct sr_nat_mapping* cur = nat->mappings;
-  while(cur){
-	  if(cur->type == type && cur->aux_ext == aux_ext){
-		  copy = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
-		  memcpy(copy, cur, sizeof(struct sr_nat_mapping));
-		  break;
-	}
-	cur = cur->next;
+
+  struct sr_nat_mapping* cur = sr_nat_find_external(nat, ip_ext, aux_ext, type);
+  if(cur && sr_nat_filter(nat, cur, ip_remote, port_remote)){
+	  copy = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
+	  memcpy(copy, cur, sizeof(struct sr_nat_mapping));
   }
-  
+  sr_stats_count(copy ? sr_stats_nat_hit : sr_stats_nat_miss);
+
 
   pthread_mutex_unlock(&(nat->lock));
   return copy;
 }
 
-/* Get the mapping associated with given internal (ip, port) pair.
+/* Get the mapping used for packets from the given internal (ip, port)
+   pair to (ip_remote, port_remote).
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_remote, uint16_t port_remote,
+  sr_nat_mapping_type type ) {
 
   pthread_mutex_lock(&(nat->lock));
 
   /* handle lookup here, malloc and assign to copy. */
   struct sr_nat_mapping *copy = NULL;
-    struct sr_nat_mapping* cur = nat->mappings;
-  while(cur){
-	  if((cur->type == type) && (cur->ip_int == ip_int) && (cur->aux_int == aux_int)){
-		  copy = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
-		  memcpy(copy, cur, sizeof(struct sr_nat_mapping));
-		  break;
-	}
-	cur = cur->next;
+  struct sr_nat_mapping* cur = sr_nat_find_internal(nat, ip_int, aux_int, type,
+                                                    sr_nat_key_ip(nat->mapping_mode, ip_remote),
+                                                    sr_nat_key_port(nat->mapping_mode, port_remote));
+  if(cur == NULL && nat->mapping_mode != nat_endpoint_independent){
+	  /* Static mappings are endpoint independent whatever the mode */
+	  cur = sr_nat_find_internal(nat, ip_int, aux_int, type, 0, 0);
   }
+  if(cur){
+	  sr_nat_permit(nat, cur, ip_remote, port_remote);
+	  copy = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
+	  memcpy(copy, cur, sizeof(struct sr_nat_mapping));
+  }
+  sr_stats_count(copy ? sr_stats_nat_hit : sr_stats_nat_miss);
 
   pthread_mutex_unlock(&(nat->lock));
   return copy;
@@ -187,178 +891,267 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
    Actually returns a copy to the new mapping, for thread safety.
  */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_remote, uint16_t port_remote,
+  sr_nat_mapping_type type ) {
 
   pthread_mutex_lock(&(nat->lock));
 
   /* handle insert here, create a mapping, and then return a copy of it */
   struct sr_nat_mapping *mapping = NULL;
-  struct sr_nat_mapping *new = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
+  struct sr_nat_host *host = sr_nat_get_host(nat, ip_int);
+  if (host == NULL) {
+    pthread_mutex_unlock(&(nat->lock));
+    return NULL;
+  }
+  if (host->mappings >= nat->limits.host_mappings) {
+    nat->drops.host_mappings++;
+    host->drops++;
+    sr_nat_put_host(nat, host);
+    pthread_mutex_unlock(&(nat->lock));
+    return NULL;
+  }
+  if (nat->mapping_pool.in_use >= nat->limits.mappings) {
+    nat->drops.mappings++;
+    host->drops++;
+    sr_nat_put_host(nat, host);
+    pthread_mutex_unlock(&(nat->lock));
+    return NULL;
+  }
+  struct sr_nat_mapping *new = (struct sr_nat_mapping *)sr_slab_alloc(&(nat->mapping_pool));
+  if (new == NULL) {
+    sr_nat_put_host(nat, host);
+    pthread_mutex_unlock(&(nat->lock));
+    return NULL;
+  }
+  struct sr_nat_addr *addr = sr_nat_pair_address(nat, ip_int);
+  struct sr_nat_det *det = sr_nat_det_internal(nat, ip_int);
+  struct sr_nat_block *block = NULL;
+  int aux_ext;
+  if (det) {
+    aux_ext = sr_nat_det_port(nat, det, ip_int, type, &block);
+  } else if (nat->block_size) {
+    aux_ext = sr_nat_block_port(nat, ip_int, addr, type, &block);
+  } else {
+    aux_ext = sr_nat_alloc_port(nat, addr, type);
+  }
+  if (aux_ext < 0) {
+    sr_slab_free(&(nat->mapping_pool), new);
+    sr_nat_put_host(nat, host);
+    pthread_mutex_unlock(&(nat->lock));
+    return NULL;
+  }
+  host->mappings++;
+  new->block = block;
+  if (block) {
+    block->used[type]++;
+    if (block->slots) {
+      block->slots[type * block->size + aux_ext - block->base] = new;
+    }
+  }
   new->type = type;
+  new->flags = 0;
   new->ip_int = ip_int;
-  new->ip_ext = nat->ext_iface->ip;
+  new->ip_ext = block ? block->ip_ext : addr->ip;
 
   new->aux_int = aux_int;
-  new->aux_ext = nat->global_auxext++;
+  new->aux_ext = aux_ext;
+  new->ip_remote = sr_nat_key_ip(nat->mapping_mode, ip_remote);
+  new->port_remote = sr_nat_key_port(nat->mapping_mode, port_remote);
   new->conns = NULL;
-  
-  new->last_updated = time(NULL);
-  
-  /* TODO: need to handle conns */
+
+  new->last_updated = nat->ticks;
+
   new->next = nat->mappings;
   nat->mappings = new;
-  
+
+  struct sr_nat_mapping **bucket = sr_nat_int_bucket(nat, ip_int, aux_int, type,
+                                                     new->ip_remote, new->port_remote);
+  new->next_int = *bucket;
+  *bucket = new;
+  /* Deterministic mappings are found through their block instead */
+  if (det == NULL) {
+    bucket = sr_nat_ext_bucket(nat, new->ip_ext, new->aux_ext, type);
+    new->next_ext = *bucket;
+    *bucket = new;
+  }
+
+  sr_nat_permit(nat, new, ip_remote, port_remote);
+
   mapping = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
   memcpy(mapping, new, sizeof(struct sr_nat_mapping));
-  
+  sr_stats_count(sr_stats_nat_insert);
+
   pthread_mutex_unlock(&(nat->lock));
   return mapping;
 }
 
-void sr_nat_add_connection(struct sr_nat *nat, struct sr_nat_mapping *copy, uint32_t ip_src, uint16_t port_src, uint32_t ip_dst, uint16_t port_dst, uint16_t isn_src, int established, 
-uint8_t *pending_packet, unsigned int len)
-{ 
+void sr_nat_refresh_mapping_time(struct sr_nat *nat, struct sr_nat_mapping *copy)
+{
 	pthread_mutex_lock(&(nat->lock));
-	struct sr_nat_mapping* cur = nat->mappings;
-	while(cur){
-		if((cur->type == copy->type) && (cur->ip_int == copy->ip_int) && (cur->aux_int == copy->aux_int)){
-			struct sr_nat_connection *new_con = malloc(sizeof(struct sr_nat_connection));
-			new_con->ip_src = ip_src;
-			new_con->port_src = port_src;
-			new_con->ip_dst = ip_dst;
-			new_con->port_dst = port_dst;
-			new_con->isn_src = isn_src;
-			new_con->isn_dst = -1;
-			new_con->established = established;
-			new_con->pending_packet = pending_packet;
-			new_con->len = len;
-			new_con->last_updated = time(NULL);
-			new_con->next = cur->conns;
-			cur->conns = new_con;
-			break;
-		}
-		cur = cur->next;
+	struct sr_nat_mapping* cur = sr_nat_find_copy(nat, copy);
+	if(cur){
+		cur->last_updated = nat->ticks;
 	}
-  
 	pthread_mutex_unlock(&(nat->lock));
-  
-  /*TODO Error checking*/
 }
 
-int sr_nat_establish_connection(struct sr_nat *nat,
-  struct sr_nat_mapping *copy, struct sr_nat_connection *con_copy){
-  
-	pthread_mutex_lock(&(nat->lock));
-	struct sr_nat_mapping* cur = nat->mappings;
-	while(cur){
-		if((cur->type == copy->type) && (cur->ip_int == copy->ip_int) && (cur->aux_int == copy->aux_int)){
-			struct sr_nat_connection* con = cur->conns;
-			while (con){
-				if (con->ip_src == con_copy->ip_src && con->port_src == con_copy->port_src && con->ip_dst == con_copy->ip_dst && con->port_dst == con_copy->port_dst){
-					con->established = 1;
-					if (con->pending_packet != NULL) {
-						free(con->pending_packet);
-						con->len = 0;
-					}
-					pthread_mutex_unlock(&(nat->lock));
-					return 1;
-				}
-				con = con->next;
-			}
-		break;
-		}
-	cur = cur->next;
+/* Allocate a connection of mapping to the remote endpoint and hash it.
+   Call with the lock held. */
+static struct sr_nat_connection *sr_nat_new_connection(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_remote, uint16_t port_remote)
+{
+	struct sr_nat_host *host = sr_nat_find_host(nat, mapping->ip_int);
+	if (host->conns >= nat->limits.host_conns) {
+		nat->drops.host_conns++;
+		host->drops++;
+		return NULL;
+	}
+	if (nat->conn_pool.in_use >= nat->limits.conns) {
+		nat->drops.conns++;
+		host->drops++;
+		return NULL;
+	}
+	struct sr_nat_connection *new_con = sr_slab_alloc(&(nat->conn_pool));
+	if (new_con == NULL) {
+		return NULL;
+	}
+	host->conns++;
+	new_con->ip_remote = ip_remote;
+	new_con->port_remote = port_remote;
+	new_con->mapping = mapping;
+	new_con->cold = NULL;
+	new_con->next = mapping->conns;
+	mapping->conns = new_con;
+
+	struct sr_nat_connection **bucket = sr_nat_conn_bucket(nat, mapping, ip_remote, port_remote);
+	new_con->next_hash = *bucket;
+	*bucket = new_con;
+	return new_con;
+}
+
+/* (Re)start a connection with a SYN from one side. An inbound SYN keeps
+   the packet for the ICMP error sent if it goes unanswered; returns -1 if
+   the pending SYN limits refuse it. */
+static int sr_nat_conn_open(struct sr_nat *nat, struct sr_nat_connection *con,
+  int outbound, uint8_t *packet, unsigned int len)
+{
+	if (outbound) {
+		/* Nothing to send an error about; drop any earlier inbound SYN */
+		sr_nat_cold_free(nat, con);
+	} else if (con->cold == NULL && sr_nat_cold_alloc(nat, con)) {
+		return -1;
+	}
+	con->state = tcp_state_syn_sent;
+	con->flags = outbound ? 0 : SR_NAT_CONN_INBOUND;
+	if (con->cold) {
+		con->cold->len = (len < SR_NAT_PENDING_LEN) ? len : SR_NAT_PENDING_LEN;
+		memcpy(con->cold->pending_packet, packet, con->cold->len);
 	}
-	pthread_mutex_unlock(&(nat->lock));
 	return 0;
 }
 
-/* src is local / internal to nat, dst is external/ servers */
-struct sr_nat_connection *sr_nat_lookup_connection(struct sr_nat *nat, struct sr_nat_mapping *copy, uint32_t ip_src, uint16_t port_src, uint32_t ip_dst, uint16_t port_dst)
-{ 
+int sr_nat_tcp_track(struct sr_nat *nat, struct sr_nat_mapping *copy,
+  uint32_t ip_remote, uint16_t port_remote, uint8_t flags, int outbound,
+  uint8_t *packet, unsigned int len)
+{
+	int syn = (flags & TH_SYN) != 0;
+	int ack = (flags & TH_ACK) != 0;
+
 	pthread_mutex_lock(&(nat->lock));
-	struct sr_nat_connection *con_copy = NULL;
-	struct sr_nat_mapping* cur = nat->mappings;
-	while(cur){
-		if((cur->type == copy->type) && (cur->ip_int == copy->ip_int) && (cur->aux_int == copy->aux_int)){
-			struct sr_nat_connection* con = cur->conns;
-			while (con){
-				if (con->ip_src == ip_src && con->port_src == port_src && con->ip_dst == ip_dst && con->port_dst == port_dst){
-					con_copy = malloc(sizeof(struct sr_nat_connection));
-					memcpy(con, con_copy, sizeof(struct sr_nat_connection));
-					
+	struct sr_nat_mapping* cur = sr_nat_find_copy(nat, copy);
+	if (cur == NULL) {
+		pthread_mutex_unlock(&(nat->lock));
+		return 0;
+	}
+
+	struct sr_nat_connection *con = sr_nat_find_connection(nat, cur, ip_remote, port_remote);
+	if (con == NULL) {
+		/* Only a SYN opens a connection, anything else passes untracked */
+		if (!syn || ack) {
+			pthread_mutex_unlock(&(nat->lock));
+			return 0;
+		}
+		con = sr_nat_new_connection(nat, cur, ip_remote, port_remote);
+		if (con == NULL) {
+			pthread_mutex_unlock(&(nat->lock));
+			return -1;
+		}
+		if (sr_nat_conn_open(nat, con, outbound, packet, len)) {
+			/* Still at the head of the mapping's list */
+			cur->conns = con->next;
+			sr_nat_free_connection(nat, con);
+			pthread_mutex_unlock(&(nat->lock));
+			return -1;
+		}
+	} else if (flags & TH_RST) {
+		con->state = tcp_state_closed;
+		sr_nat_cold_free(nat, con);
+	} else {
+		switch (con->state) {
+			case tcp_state_syn_sent:
+				/* SYN+ACK, or the SYN of a simultaneous open, from the
+				 * side that did not open the connection */
+				if (syn && (outbound == ((con->flags & SR_NAT_CONN_INBOUND) != 0))) {
+					con->state = tcp_state_syn_recv;
+					/* The internal host answered, no ICMP error needed */
+					sr_nat_cold_free(nat, con);
+				}
+				break;
+			case tcp_state_syn_recv:
+				if (ack && !syn) {
+					con->state = tcp_state_established;
+				}
+				break;
+			case tcp_state_time_wait:
+			case tcp_state_closed:
+				/* New connection reusing the same endpoints */
+				if (syn && !ack && sr_nat_conn_open(nat, con, outbound, packet, len)) {
 					pthread_mutex_unlock(&(nat->lock));
-					return con_copy;
+					return -1;
 				}
-				con = con->next;
-			}		
-			break;
+				break;
+			default:
+				break;
+		}
+
+		if ((flags & TH_FIN) && con->state >= tcp_state_syn_recv && con->state <= tcp_state_close_wait) {
+			con->flags |= outbound ? SR_NAT_CONN_FIN_INT : SR_NAT_CONN_FIN_EXT;
+			if ((con->flags & SR_NAT_CONN_FIN_INT) && (con->flags & SR_NAT_CONN_FIN_EXT)) {
+				con->state = tcp_state_time_wait;
+			} else {
+				con->state = outbound ? tcp_state_fin_wait : tcp_state_close_wait;
+			}
 		}
-		cur = cur->next;
 	}
+
+	con->last_updated = nat->ticks;
+	cur->last_updated = nat->ticks;
 	pthread_mutex_unlock(&(nat->lock));
-	return con_copy;
+	return 0;
 }
 
-
-void sr_nat_refresh_connection_time(struct sr_nat *nat, struct sr_nat_mapping *copy, struct sr_nat_connection* con_copy)
+uint8_t *sr_nat_frag_reassemble(struct sr_nat *nat, uint8_t *packet,
+  unsigned int len, unsigned int *out_len)
 {
 	pthread_mutex_lock(&(nat->lock));
-	struct sr_nat_mapping* cur = nat->mappings;
-	while(cur){
-		if((cur->type == copy->type) && (cur->ip_int == copy->ip_int) && (cur->aux_int == copy->aux_int)){
-			struct sr_nat_connection* con = cur->conns;
-			while (con){
-				if (con->ip_src == con_copy->ip_src && con->port_src == con_copy->port_src
-						&& con->ip_dst == con_copy->ip_dst && con->port_dst == con_copy->port_dst){
-					con->last_updated = time(NULL);
-					cur->last_updated = time(NULL);
-					break;
-				}
-				con = con->next;
-			}
-			break;
-		}
-		cur = cur->next;
-	}
+	uint8_t *whole = sr_frag_reassemble(&(nat->frags), packet, len, out_len, nat->ticks);
 	pthread_mutex_unlock(&(nat->lock));
+	return whole;
 }
 
-
-void sr_nat_refresh_mapping_time(struct sr_nat *nat, struct sr_nat_mapping *copy)
+struct sr_frag_piece *sr_nat_frag_translated(struct sr_nat *nat,
+  sr_ip_hdr_t *orig, uint32_t new_src, uint32_t new_dst)
 {
 	pthread_mutex_lock(&(nat->lock));
-	struct sr_nat_mapping* cur = nat->mappings;
-	while(cur){
-		if((cur->type == copy->type) && (cur->ip_int == copy->ip_int) && (cur->aux_int == copy->aux_int)){
-			cur->last_updated = time(NULL);
-			break;
-		}
-		cur = cur->next;
-	}
+	struct sr_frag_piece *pieces = sr_frag_translated(&(nat->frags), orig, new_src, new_dst, nat->ticks);
 	pthread_mutex_unlock(&(nat->lock));
+	return pieces;
 }
 
-/* src is local / internal to nat, dst is external/ servers */
-int sr_update_isn(struct sr_nat *nat, struct sr_nat_mapping *copy, struct sr_nat_connection *con_copy, uint16_t isn_src, uint16_t isn_dst){
+int sr_nat_frag_follow(struct sr_nat *nat, uint8_t *packet, unsigned int len)
+{
 	pthread_mutex_lock(&(nat->lock));
-	struct sr_nat_mapping* cur = nat->mappings;
-	while(cur){
-		if((cur->type == copy->type) && (cur->ip_int == copy->ip_int) && (cur->aux_int == copy->aux_int)){
-			struct sr_nat_connection* con = cur->conns;
-			while (con){
-				if (con->ip_src == con_copy->ip_src && con->port_src == con_copy->port_src && con->ip_dst == con_copy->ip_dst && con->port_dst == con_copy->port_dst){
-					con->isn_src = isn_src;
-					con->isn_dst = isn_dst;
-					pthread_mutex_unlock(&(nat->lock));
-					return 1;
-				}
-				con = con->next;
-			}	
-			break;
-		}
-		cur = cur->next;
-	}
+	int result = sr_frag_follow(&(nat->frags), packet, len, nat->ticks);
 	pthread_mutex_unlock(&(nat->lock));
-	return 0;
+	return result;
 }
@@ -7,58 +7,280 @@
 #include <pthread.h>
 #include "sr_if.h"
 #include "sr_router.h"
+#include "sr_slab.h"
+#include "sr_frag.h"
+
+/* RFC 4787 mapping and filtering behaviour. For mapping, which parts of
+   the remote endpoint select the mapping of an internal (ip, port); for
+   filtering, which inbound packets a mapping accepts: from anyone, only
+   from addresses, or only from (address, port)s the internal host has
+   sent to. */
+typedef enum {
+  nat_endpoint_independent,
+  nat_address_dependent,
+  nat_address_port_dependent
+} sr_nat_behavior;
 
 typedef enum {
   nat_mapping_icmp,
-  nat_mapping_tcp
-  /* nat_mapping_udp, */
+  nat_mapping_tcp,
+  nat_mapping_udp,
+  nat_mapping_type_count
 } sr_nat_mapping_type;
 
+/* Mapping and connection records are laid out so that everything a
+   lookup compares and everything needed to translate a packet sits in one
+   64-byte cache line. The pools hand them out on line boundaries. */
+#define SR_NAT_CACHE_LINE 64
+
+/* NAT view of a TCP connection, driven by the flags seen in both
+   directions. FIN_WAIT means the internal host sent the first FIN,
+   CLOSE_WAIT that the remote host did; once both sides have sent a FIN
+   the connection is in TIME_WAIT. A RST moves it to CLOSED. */
+typedef enum {
+  tcp_state_syn_sent,
+  tcp_state_syn_recv,
+  tcp_state_established,
+  tcp_state_fin_wait,
+  tcp_state_close_wait,
+  tcp_state_time_wait,
+  tcp_state_closed,
+  tcp_state_count
+} sr_nat_tcp_state;
+
+/* sr_nat_connection flags */
+#define SR_NAT_CONN_INBOUND 0x01  /* opened by a SYN from the remote host */
+#define SR_NAT_CONN_FIN_INT 0x02  /* internal host has sent a FIN */
+#define SR_NAT_CONN_FIN_EXT 0x04  /* remote host has sent a FIN */
+#define SR_NAT_CONN_PERMIT  0x08  /* only records that the internal host
+                                     sent to this endpoint, for filtering */
+
+/* What ICMP port unreachable needs of an unsolicited SYN: the sender's
+   MAC, the IP header and the first 8 bytes of the segment */
+#define SR_NAT_PENDING_LEN (sizeof(sr_ethernet_hdr_t) + ICMP_DATA_SIZE)
+
+/* State only needed while an unsolicited inbound SYN waits for the
+   internal host. Kept out of line and released once it is answered. */
+struct sr_nat_conn_cold {
+	/* Copy of the head of the unsolicited packet and its length */
+	uint8_t pending_packet[SR_NAT_PENDING_LEN];
+	unsigned int len;
+};
+
+/* A TCP connection through a mapping. The internal endpoint is the
+   mapping's (ip_int, aux_int); a connection is identified by its mapping
+   and the remote endpoint. Unless filtering is endpoint independent,
+   connection records are also the filter: a packet from a remote host is
+   let in if its mapping has a record for (ip, port), or (ip, 0) under
+   address dependent filtering. Permit records stand in for that on
+   mappings without a TCP connection to the endpoint. */
 struct sr_nat_connection {
   /* add TCP connection state data members here */
-	uint32_t ip_dst;
-	uint16_t port_dst;
-	
-	uint32_t ip_src;
-	uint16_t port_src;
+	uint32_t ip_remote;
+	uint16_t port_remote;
 	
-	/* isn from dst */
-	uint16_t isn_dst;
-	/* isn from src */
-	uint16_t isn_src;
-	/* 0: new connection to be established; 1: connection established 
-	 * -1: connection pending */
-	int established;
+	uint8_t state; /* sr_nat_tcp_state */
+	uint8_t flags; /* SR_NAT_CONN_* */
 	
-	/* The unsocilidated packet and its length*/
-	uint8_t *pending_packet;
-	unsigned int len;
-	
-	time_t last_updated;
+	uint32_t last_updated; /* nat->ticks */
 	
-  struct sr_nat_connection *next;
+	struct sr_nat_mapping *mapping; /* owning mapping, part of the key */
+	struct sr_nat_conn_cold *cold; /* pending unsolicited SYN, or NULL */
+  struct sr_nat_connection *next; /* list of the mapping's connections */
+  struct sr_nat_connection *next_hash; /* chain in nat->conn_table */
 };
 
 struct sr_nat_mapping {
-  sr_nat_mapping_type type;
   uint32_t ip_int; /* internal ip addr */
   uint32_t ip_ext; /* external ip addr */
   uint16_t aux_int; /* internal port or icmp id */
   uint16_t aux_ext; /* external port or icmp id */
-  time_t last_updated; /* use to timeout mappings */
-  struct sr_nat_connection *conns; /* list of connections. null for ICMP */
-  struct sr_nat_mapping *next;
+  uint8_t type; /* sr_nat_mapping_type */
+  uint8_t flags; /* SR_NAT_MAPPING_* */
+  uint16_t port_remote; /* remote port, if part of the mapping key */
+  uint32_t ip_remote; /* remote ip addr, if part of the mapping key */
+  uint32_t last_updated; /* nat->ticks, use to timeout mappings */
+  struct sr_nat_connection *conns; /* connections and filter permits */
+  struct sr_nat_mapping *next_int; /* chain in the internal lookup table */
+  struct sr_nat_mapping *next_ext; /* chain in the external lookup table */
+  struct sr_nat_mapping *next; /* list of all mappings, for timeouts */
+  struct sr_nat_block *block; /* port block aux_ext came from, if any */
+};
+
+/* sr_nat_mapping flags */
+#define SR_NAT_MAPPING_STATIC 0x01  /* port forwarding rule, never expires */
+
+/* Fail the build if a record outgrows its cache line */
+typedef char sr_nat_mapping_fits_line
+  [(sizeof(struct sr_nat_mapping) <= SR_NAT_CACHE_LINE) ? 1 : -1];
+typedef char sr_nat_connection_fits_line
+  [(sizeof(struct sr_nat_connection) <= SR_NAT_CACHE_LINE) ? 1 : -1];
+
+/* External ports and ICMP ids handed out on each address */
+#define SR_NAT_PORT_MIN 1024
+#define SR_NAT_PORT_MAX 65535
+
+/* Most external addresses in the pool */
+#define SR_NAT_MAX_ADDRS 16
+
+/* An external address and where its port allocation resumes. With
+   port blocks, free_blocks is a stack of the bases of its free blocks. */
+struct sr_nat_addr {
+  uint32_t ip;
+  uint16_t next_port;
+  uint16_t *free_blocks;
+  unsigned int free_count;
+};
+
+/* Most deterministic NAT prefixes, and the longest host part of one */
+#define SR_NAT_MAX_DET 8
+#define SR_NAT_DET_MIN_LEN 16
+
+/* Deterministic NAT (RFC 7422) for an internal prefix: host k of the
+   prefix always gets external address ext_first + k / hosts_per_addr and
+   the ports_per_host ports from SR_NAT_PORT_MIN + (k % hosts_per_addr) *
+   ports_per_host, so either side can be computed from the other. Fields
+   in host byte order. */
+struct sr_nat_det {
+  uint32_t int_net;
+  uint32_t int_hosts; /* size of the prefix */
+  uint32_t ext_first;
+  uint32_t ext_count;
+  uint32_t hosts_per_addr;
+  uint16_t ports_per_host;
+  struct sr_nat_block **hosts; /* block of host k, NULL if it has none */
+};
+
+/* A contiguous range of ports on one external address, owned by one
+   internal host. Its mappings take ports from it without going back to
+   the address; it returns to the address once none are left.
+   Deterministic blocks are not taken from an address but computed, and
+   index their mappings by port in slots. */
+struct sr_nat_block {
+  uint32_t ip_int;
+  uint32_t ip_ext;
+  struct sr_nat_addr *addr; /* NULL for deterministic blocks */
+  struct sr_nat_det *det; /* NULL for dynamic blocks */
+  uint16_t base; /* first port */
+  uint16_t size; /* number of ports */
+  uint16_t cursor; /* next port to try */
+  uint16_t used[nat_mapping_type_count]; /* mappings of each type */
+  struct sr_nat_mapping **slots; /* [type * size + port - base] */
+  struct sr_nat_block *next; /* chain in the block table */
+};
+
+/* What one internal host holds in the NAT, for its quotas. Created with
+   its first mapping and released with its last record. */
+struct sr_nat_host {
+  uint32_t ip_int;
+  unsigned int mappings;
+  unsigned int conns; /* connections and filter permits */
+  unsigned int pending; /* unanswered inbound SYNs held for ICMP */
+  unsigned int drops; /* records refused to this host */
+  struct sr_nat_host *next; /* chain in the host table */
+};
+
+/* Per-host and global record limits */
+struct sr_nat_limits {
+  unsigned int host_mappings;
+  unsigned int host_conns;
+  unsigned int host_pending;
+  unsigned int mappings;
+  unsigned int conns;
+  unsigned int pending;
+};
+
+/* Records refused because a limit was hit, by limit */
+struct sr_nat_drops {
+  unsigned int host_mappings;
+  unsigned int host_conns;
+  unsigned int host_pending;
+  unsigned int mappings;
+  unsigned int conns;
+  unsigned int pending;
 };
 
 struct sr_nat {
   /* add any fields here */
   struct sr_nat_mapping *mappings;
-  uint16_t global_auxext;
+  
+  /* External address pool, filled before sr_nat_init; defaults to the
+     external interface's address */
+  struct sr_nat_addr ext_addrs[SR_NAT_MAX_ADDRS];
+  unsigned int ext_count;
+  
+  /* Port blocks: ports per block (0 to allocate port by port) and most
+     blocks one internal host may hold, both set before the pool is
+     filled. Blocks are hashed by ip_int; block_mask + 1 buckets. */
+  uint16_t block_size;
+  uint16_t max_blocks;
+  struct sr_nat_block **block_table;
+  uint32_t block_mask;
+  
+  /* Static port forwarding on the first external address: per type,
+     NULL or 65536 entries indexed by external port, each the rule's
+     permanent mapping or NULL */
+  struct sr_nat_mapping **static_table[nat_mapping_type_count];
+  uint32_t static_ip;
+  const char *static_file; /* rules to load, or NULL */
+  
+  /* Deterministic NAT prefixes, tried before the dynamic pool */
+  struct sr_nat_det det[SR_NAT_MAX_DET];
+  unsigned int det_count;
+  
+  sr_nat_behavior mapping_mode;
+  sr_nat_behavior filtering_mode;
+  
+  /* Limits, set before sr_nat_init, and what they refused. The pool of
+     held SYNs is preallocated to its global limit. Hosts are
+     hashed by ip_int; host_mask + 1 buckets. */
+  struct sr_nat_limits limits;
+  struct sr_nat_drops drops;
+  struct sr_nat_host **host_table;
+  uint32_t host_mask;
+  
+  /* Mappings hashed by (type, ip_int, aux_int, remote part of the key)
+     and by (type, ip_ext, aux_ext).
+     Both tables have table_mask + 1 buckets. */
+  struct sr_nat_mapping **int_table;
+  struct sr_nat_mapping **ext_table;
+  uint32_t table_mask;
+  
+  /* Connections hashed by (mapping, ip_remote, port_remote), so finding
+     one costs the same however many connections its mapping has.
+     conn_mask + 1 buckets. */
+  struct sr_nat_connection **conn_table;
+  uint32_t conn_mask;
+  
+  /* Coarse clock: whole seconds since sr_nat_init, advanced by the
+     timeout thread so the packet path never calls time() */
+  time_t epoch;
+  uint32_t ticks;
   
   uint16_t icmp_timeout;
+  uint16_t udp_timeout;
   uint16_t tcp_establish_timeout;
   uint16_t tcp_transitory_timeout;
+  uint16_t tcp_fin_timeout;
+  uint16_t tcp_closed_timeout;
   uint16_t tcp_unsolicited_syn_timeout;
+  /* Idle timeout of a connection in each state, built from the above */
+  uint16_t tcp_timeouts[tcp_state_count];
+  
+  /* Mapping and connection records come from these pools; the counts are
+     how many of each to preallocate in sr_nat_init */
+  unsigned int pool_mappings;
+  unsigned int pool_conns;
+  struct sr_slab mapping_pool;
+  struct sr_slab conn_pool;
+  struct sr_slab cold_pool;
+  struct sr_slab block_pool;
+  struct sr_slab host_pool;
+  
+  /* Fragmented datagrams crossing the NAT; mode and limits set before
+     sr_nat_init */
+  sr_frag_mode frag_mode;
+  struct sr_frag_table frags;
   
   struct sr_if *int_iface;
   struct sr_if *ext_iface;
@@ -73,34 +295,65 @@ struct sr_nat {
 
 int   sr_nat_init(struct sr_instance *sr);     /* Initializes the nat */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
+void  sr_nat_dump_pools(struct sr_nat *nat);  /* Prints pool usage and drops */
+
+/* Add ip to the external address pool. Returns -1 if the pool is full. */
+int   sr_nat_add_address(struct sr_nat *nat, uint32_t ip);
+/* Translate the internal prefix net/len deterministically to the count
+   external addresses from ext_first (all network byte order). Returns -1
+   if the prefix is too large to fit or too many are configured. */
+int   sr_nat_add_det(struct sr_nat *nat, uint32_t net, unsigned int len,
+                     uint32_t ext_first, unsigned int count);
+/* Load static port forwarding rules, one per line:
+     tcp|udp ext_port[-last_ext_port] int_ip int_port
+   forwarding the external port (range) on the first external address to
+   int_ip from int_port on. Call once the external addresses are set.
+   Returns -1 on error. */
+int   sr_nat_load_static(struct sr_nat *nat, const char *filename);
+/* Whether ip is one of the NAT's external addresses */
+int   sr_nat_is_external(struct sr_nat *nat, uint32_t ip);
 void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
 
-/* Get the mapping associated with given external port.
+/* Get the mapping associated with given external (ip, port), if its
+   filtering lets in a packet from (ip_remote, port_remote).
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+    uint32_t ip_ext, uint16_t aux_ext, uint32_t ip_remote, uint16_t port_remote,
+    sr_nat_mapping_type type );
 
-/* Get the mapping associated with given internal (ip, port) pair.
+/* Get the mapping used for packets from the given internal (ip, port)
+   pair to (ip_remote, port_remote), and record that the internal host
+   sent to that endpoint.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_remote, uint16_t port_remote,
+  sr_nat_mapping_type type );
 
-/* Insert a new mapping into the nat's mapping table.
+/* Insert a new mapping into the nat's mapping table, for packets from the
+   internal (ip, port) pair to (ip_remote, port_remote).
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_remote, uint16_t port_remote,
+  sr_nat_mapping_type type );
 
-struct sr_nat_connection *sr_nat_lookup_connection(struct sr_nat *nat, struct sr_nat_mapping *copy, uint32_t ip_src, uint16_t port_src, uint32_t ip_dst, uint16_t port_dst);
-  
-void sr_nat_add_connection(struct sr_nat *nat, struct sr_nat_mapping *copy, uint32_t ip_src, uint16_t port_src, uint32_t ip_dst, uint16_t port_dst, uint16_t isn_src, int established, 
-uint8_t *pending_packet, unsigned int len);
-  
-int sr_nat_establish_connection(struct sr_nat *nat,
-  struct sr_nat_mapping *copy, struct sr_nat_connection *con_copy);
+/* Run the TCP state machine for a segment with the given flags, sent
+   by the internal host (outbound) or by the remote host. A SYN with no
+   connection opens one; for an inbound SYN, the head of packet is copied
+   so the remote host can be sent ICMP port unreachable if the internal
+   host never answers. Refreshes the connection and the mapping. Returns 0 to
+   forward the segment, -1 to drop it. */
+int sr_nat_tcp_track(struct sr_nat *nat, struct sr_nat_mapping *copy,
+  uint32_t ip_remote, uint16_t port_remote, uint8_t flags, int outbound,
+  uint8_t *packet, unsigned int len);
 
 void sr_nat_refresh_mapping_time(struct sr_nat *nat, struct sr_nat_mapping *copy);
 
-void sr_nat_refresh_connection_time(struct sr_nat *nat, struct sr_nat_mapping *copy, struct sr_nat_connection* con_copy);
+/* sr_frag_reassemble, sr_frag_translated and sr_frag_follow on the NAT's
+   fragment table, under its lock and clock */
+uint8_t *sr_nat_frag_reassemble(struct sr_nat *nat, uint8_t *packet,
+  unsigned int len, unsigned int *out_len);
+struct sr_frag_piece *sr_nat_frag_translated(struct sr_nat *nat,
+  sr_ip_hdr_t *orig, uint32_t new_src, uint32_t new_dst);
+int sr_nat_frag_follow(struct sr_nat *nat, uint8_t *packet, unsigned int len);
 
-int sr_update_isn(struct sr_nat *nat, struct sr_nat_mapping *copy, struct sr_nat_connection *con_copy, uint16_t isn_src, uint16_t isn_dst);
 #endif
@@ -0,0 +1,368 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_nat_bench.c
+ *
+ * Description:
+ *
+ * Benchmark of NAT mapping lookups, built apart from the router with
+ * "make sr_nat_bench". It fills a NAT with a million mappings (-n) and
+ * times lookups of random existing ones, in both directions, through the
+ * same sr_nat_lookup_internal/_external calls the packet path makes.
+ *
+ * For comparison it also builds the table as the router first kept it:
+ * records of the original layout, each malloc'd on its own, on a single
+ * list walked from the head. Far fewer of those lookups are run (-b), as
+ * each walks half the list on average.
+ *
+ * Where the kernel lets a process count its own hardware events, cache
+ * misses per lookup are reported alongside the time; otherwise only the
+ * time is.
+ *
+ * The NAT's timeout thread still sweeps the table once a second, under
+ * the lock, which adds some noise to the current table's figures.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_nat.h"
+
+#define DEFAULT_MAPPINGS 1000000
+#define DEFAULT_LOOKUPS 1000000
+#define DEFAULT_BASELINE_LOOKUPS 200
+
+/* Internal hosts the mappings are spread over */
+#define BENCH_HOSTS 4096
+
+/* A mapping as the router first laid it out */
+struct bench_old_mapping {
+  sr_nat_mapping_type type;
+  uint32_t ip_int;
+  uint32_t ip_ext;
+  uint16_t aux_int;
+  uint16_t aux_ext;
+  time_t last_updated;
+  struct sr_nat_connection *conns;
+  struct bench_old_mapping *next;
+};
+
+/* What a lookup is asked for, in the order the lookups are made */
+struct bench_key {
+  uint32_t ip_int;
+  uint32_t ip_ext;
+  uint16_t aux_int;
+  uint16_t aux_ext; /* host order */
+  uint8_t type;
+};
+
+/* The router's main() lives in sr_main.c, which the benchmark replaces */
+int sr_verify_routing_table(struct sr_instance* sr)
+{
+    return 0;
+}
+
+static uint32_t bench_random(uint32_t *state)
+{
+    /* xorshift32 */
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static uint64_t bench_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A counter of this thread's cache misses, or -1 if it can't be had */
+static int bench_counter_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void bench_counter_start(int fd)
+{
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static uint64_t bench_counter_stop(int fd)
+{
+    uint64_t count = 0;
+
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+    }
+    return count;
+}
+
+static void bench_report(const char *name, unsigned int lookups,
+                         unsigned int found, uint64_t ns, int fd,
+                         uint64_t misses)
+{
+    printf("%-18s %8u lookups, %u found, %10.1f ns/lookup", name, lookups,
+           found, (double) ns / lookups);
+    if (fd >= 0) {
+        printf(", %8.2f cache misses/lookup", (double) misses / lookups);
+    }
+    printf("\n");
+}
+
+/* Shuffle keys, so lookups land all over the table */
+static void bench_shuffle(struct bench_key *keys, unsigned int count,
+                          uint32_t *seed)
+{
+    struct bench_key tmp;
+    unsigned int i, j;
+
+    for (i = count - 1; i > 0; i--) {
+        j = bench_random(seed) % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+static void bench_current(struct sr_nat *nat, struct bench_key *keys,
+                          unsigned int count, unsigned int lookups, int fd)
+{
+    struct sr_nat_mapping *copy;
+    struct bench_key *key;
+    unsigned int i, found;
+    uint64_t start, ns, misses;
+
+    found = 0;
+    start = bench_clock();
+    bench_counter_start(fd);
+    for (i = 0; i < lookups; i++) {
+        key = &keys[i % count];
+        copy = sr_nat_lookup_internal(nat, key->ip_int, key->aux_int, 0, 0,
+                                      key->type);
+        if (copy) {
+            found++;
+            free(copy);
+        }
+    }
+    misses = bench_counter_stop(fd);
+    ns = bench_clock() - start;
+    bench_report("current internal", lookups, found, ns, fd, misses);
+
+    found = 0;
+    start = bench_clock();
+    bench_counter_start(fd);
+    for (i = 0; i < lookups; i++) {
+        key = &keys[i % count];
+        copy = sr_nat_lookup_external(nat, key->ip_ext, key->aux_ext, 0, 0,
+                                      key->type);
+        if (copy) {
+            found++;
+            free(copy);
+        }
+    }
+    misses = bench_counter_stop(fd);
+    ns = bench_clock() - start;
+    bench_report("current external", lookups, found, ns, fd, misses);
+}
+
+/* The original lookup: walk every mapping, copy the match out */
+static struct bench_old_mapping *bench_old_lookup(struct bench_old_mapping *head,
+                                                  uint32_t ip_int,
+                                                  uint16_t aux_int,
+                                                  sr_nat_mapping_type type)
+{
+    struct bench_old_mapping *cur, *copy = NULL;
+
+    for (cur = head; cur; cur = cur->next) {
+        if (cur->type == type && cur->ip_int == ip_int &&
+            cur->aux_int == aux_int) {
+            copy = (struct bench_old_mapping *) malloc(sizeof(*copy));
+            memcpy(copy, cur, sizeof(*copy));
+            break;
+        }
+    }
+    return copy;
+}
+
+static void bench_baseline(struct bench_key *keys, unsigned int count,
+                           unsigned int lookups, int fd)
+{
+    struct bench_old_mapping *head = NULL, *old, *next;
+    struct bench_key *key;
+    unsigned int i, found = 0;
+    uint64_t start, ns, misses;
+
+    for (i = 0; i < count; i++) {
+        old = (struct bench_old_mapping *) malloc(sizeof(*old));
+        if (old == NULL) {
+            fprintf(stderr, "Out of memory building the baseline table\n");
+            exit(1);
+        }
+        old->type = keys[i].type;
+        old->ip_int = keys[i].ip_int;
+        old->ip_ext = keys[i].ip_ext;
+        old->aux_int = keys[i].aux_int;
+        old->aux_ext = keys[i].aux_ext;
+        old->last_updated = time(NULL);
+        old->conns = NULL;
+        old->next = head;
+        head = old;
+    }
+
+    start = bench_clock();
+    bench_counter_start(fd);
+    for (i = 0; i < lookups; i++) {
+        key = &keys[i % count];
+        old = bench_old_lookup(head, key->ip_int, key->aux_int, key->type);
+        if (old) {
+            found++;
+            free(old);
+        }
+    }
+    misses = bench_counter_stop(fd);
+    ns = bench_clock() - start;
+    bench_report("baseline internal", lookups, found, ns, fd, misses);
+
+    for (old = head; old; old = next) {
+        next = old->next;
+        free(old);
+    }
+}
+
+static void usage(char *argv0)
+{
+    printf("Format: %s [-n mappings] [-l lookups] [-b baseline lookups]\n",
+           argv0);
+}
+
+int main(int argc, char **argv)
+{
+    struct sr_instance sr;
+    struct sr_nat *nat;
+    struct sr_nat_mapping *copy;
+    struct bench_key *keys;
+    unsigned int mappings = DEFAULT_MAPPINGS;
+    unsigned int lookups = DEFAULT_LOOKUPS;
+    unsigned int baseline_lookups = DEFAULT_BASELINE_LOOKUPS;
+    unsigned int i, count;
+    uint32_t seed = 2463534242u;
+    int c, fd;
+
+    while ((c = getopt(argc, argv, "hn:l:b:")) != EOF) {
+        switch (c) {
+        case 'n':
+            mappings = atoi(optarg);
+            break;
+        case 'l':
+            lookups = atoi(optarg);
+            break;
+        case 'b':
+            baseline_lookups = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            exit(0);
+        }
+    }
+    if (mappings == 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    memset(&sr, 0, sizeof(sr));
+    nat = (struct sr_nat *) calloc(1, sizeof(struct sr_nat));
+    keys = (struct bench_key *) malloc(mappings * sizeof(struct bench_key));
+    if (nat == NULL || keys == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    sr.nat = nat;
+
+    /* Nothing expires or hits a limit while the benchmark runs */
+    nat->icmp_timeout = nat->udp_timeout = 0xffff;
+    nat->tcp_establish_timeout = nat->tcp_transitory_timeout = 0xffff;
+    nat->tcp_fin_timeout = nat->tcp_closed_timeout = 0xffff;
+    nat->tcp_unsolicited_syn_timeout = 0xffff;
+    nat->pool_mappings = mappings;
+    nat->pool_conns = 0;
+    nat->mapping_mode = nat_endpoint_independent;
+    nat->filtering_mode = nat_endpoint_independent;
+    nat->limits.host_mappings = mappings;
+    nat->limits.host_conns = mappings;
+    nat->limits.host_pending = mappings;
+    nat->limits.mappings = mappings;
+    nat->limits.conns = mappings;
+    nat->limits.pending = 0;
+    nat->frag_mode = sr_frag_mode_virtual;
+    nat->block_size = 0;
+    for (i = 0; i < SR_NAT_MAX_ADDRS; i++) {
+        sr_nat_add_address(nat, htonl(0xcb007101 + i));
+    }
+    sr_nat_init(&sr);
+
+    /* TCP and UDP take turns, as each has its own ports on every address */
+    printf("Inserting %u mappings\n", mappings);
+    for (count = 0; count < mappings; count++) {
+        keys[count].ip_int = htonl(0x0a000000 + count % BENCH_HOSTS);
+        keys[count].aux_int = htons(1024 + count / BENCH_HOSTS);
+        keys[count].type = (count & 1) ? nat_mapping_udp : nat_mapping_tcp;
+        copy = sr_nat_insert_mapping(nat, keys[count].ip_int,
+                                     keys[count].aux_int, 0, 0,
+                                     keys[count].type);
+        if (copy == NULL) {
+            break;
+        }
+        keys[count].ip_ext = copy->ip_ext;
+        keys[count].aux_ext = copy->aux_ext;
+        free(copy);
+    }
+    if (count < mappings) {
+        printf("The NAT ran out of ports after %u mappings\n", count);
+    }
+
+    bench_shuffle(keys, count, &seed);
+    fd = bench_counter_open();
+    if (fd < 0) {
+        printf("Hardware cache miss counter unavailable, timing only\n");
+    }
+    printf("Mapping record %u bytes (%u cache line), original %u bytes\n",
+           (unsigned int) sizeof(struct sr_nat_mapping), (unsigned int)
+           ((sizeof(struct sr_nat_mapping) + SR_NAT_CACHE_LINE - 1) /
+            SR_NAT_CACHE_LINE),
+           (unsigned int) sizeof(struct bench_old_mapping));
+
+    bench_current(nat, keys, count, lookups, fd);
+    bench_baseline(keys, count, baseline_lookups, fd);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(keys);
+    return 0;
+}
@@ -156,6 +156,7 @@ typedef struct sr_ethernet_hdr sr_ethernet_hdr_t;
 enum sr_ip_protocol {
   ip_protocol_icmp = 0x0001,
   ip_protocol_tcp = 0x0006,
+  ip_protocol_udp = 0x0011,
 };
 
 enum sr_ethertype {
@@ -217,6 +218,14 @@ struct sr_tcp_hdr {
 };
 typedef struct sr_tcp_hdr sr_tcp_hdr_t;
 
+struct sr_udp_hdr {
+  uint16_t uh_sport;  /* source port */
+  uint16_t uh_dport;  /* destination port */
+  uint16_t uh_ulen;   /* udp length */
+  uint16_t uh_sum;    /* udp checksum, 0 if not computed */
+} __attribute__ ((packed)) ;
+typedef struct sr_udp_hdr sr_udp_hdr_t;
+
 struct sr_tcp_pseudo {
    uint32_t ip_src; /* source ip */
    uint32_t ip_dst; /* destination ip */
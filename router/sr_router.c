@@ -15,6 +15,8 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
 
 
 #include "sr_if.h"
@@ -25,8 +27,11 @@
 #include "sr_utils.h"
 
 #include "sr_nat.h"
+#include "sr_stats.h"
 
 int sr_checkIPchecksum(sr_ip_hdr_t *iphdr);
+static int sr_sendIPnow(struct sr_instance* sr, uint8_t * packet,
+			unsigned int len, struct sr_if* out_if);
 void sr_handleIPforwarding(struct sr_instance* sr,
 			   uint8_t * packet/* lent */,
 			   unsigned int len,
@@ -71,6 +76,35 @@ void sr_receiveNATpacket(struct sr_instance* sr,
 			   unsigned int len,
 			   char* interface/* lent */);
 
+void sr_hairpinNATpacket(struct sr_instance* sr,
+			   uint8_t * packet/* lent */,
+			   unsigned int len,
+			   char* interface/* lent */,
+			   sr_ip_hdr_t *first_frag);
+
+void sr_receiveNATerror(struct sr_instance* sr,
+			   uint8_t * packet/* lent */,
+			   unsigned int len,
+			   char* interface/* lent */);
+
+void sr_clampTCPMSS(sr_tcp_hdr_t *tcphdr, unsigned int tcp_len,
+		    struct sr_if *out_if);
+
+typedef void (*sr_nat_translate_fn)(struct sr_instance*, uint8_t*,
+			   unsigned int, char*);
+
+int sr_handleNATfragment(struct sr_instance* sr,
+			   uint8_t * packet/* lent */,
+			   unsigned int len,
+			   char* interface/* lent */,
+			   sr_nat_translate_fn translate);
+
+void sr_forwardNATfirstfragment(struct sr_instance* sr,
+			   sr_ip_hdr_t *orig,
+			   uint8_t * packet/* lent */,
+			   unsigned int len,
+			   char* interface/* lent */);
+
 
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
@@ -88,6 +122,20 @@ void sr_init(struct sr_instance* sr)
 	/* Initialize cache and cache cleanup thread */
 	sr_arpcache_init(&(sr->cache));
 
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	int i;
+	for (i = 0; i < 256; i++) {
+		sr_tb_init(&sr->icmp_limit.types[i], sr->icmp_limit.type_rate,
+			   sr->icmp_limit.type_rate, &now);
+		sr->icmp_limit.suppressed[i] = 0;
+	}
+	for (i = 0; i < SR_ICMP_SOURCES; i++) {
+		sr_tb_init(&sr->icmp_limit.sources[i], sr->icmp_limit.source_rate,
+			   sr->icmp_limit.source_rate, &now);
+	}
+	pthread_mutex_init(&(sr->icmp_limit.lock), NULL);
+
 	pthread_attr_init(&(sr->attr));
 	pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
 	pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
@@ -114,6 +162,13 @@ void sr_enable_NAT(struct sr_instance* sr, int nat_enable)
 
 	sr->nat->int_iface =  sr_get_interface(sr,"eth1");
 	sr->nat->ext_iface =  sr_get_interface(sr,"eth2");
+	if (sr->nat->ext_count == 0) {
+		sr_nat_add_address(sr->nat, sr->nat->ext_iface->ip);
+	}
+	if (sr->nat->static_file && sr_nat_load_static(sr->nat, sr->nat->static_file)) {
+		fprintf(stderr, "Failed loading NAT forwarding rules\n");
+		exit(1);
+	}
 
 }
 
@@ -150,8 +205,13 @@ void sr_handlepacket(struct sr_instance* sr,
 	/* fill in code here */
 	int result;
 
-	if (len > 1514){
+	struct sr_if* in_interface = sr_get_interface(sr, interface);
+	if (in_interface) {
+		sr_stats_rx(in_interface->index, len);
+	}
+	if (in_interface && len > sizeof(sr_ethernet_hdr_t) + in_interface->mtu){
 		fprintf(stderr, "Failed to handle ETHERNET packet, max MTU exceeded\n");
+		sr_stats_drop(sr_stats_drop_malformed);
 		return;
 	}
 
@@ -159,6 +219,7 @@ void sr_handlepacket(struct sr_instance* sr,
 	int minlength = sizeof(sr_ethernet_hdr_t);
 	if (len < minlength) {
 		fprintf(stderr, "Failed to handle ETHERNET packet, insufficient packet length\n");
+		sr_stats_drop(sr_stats_drop_malformed);
 		return;
 	}
 
@@ -174,6 +235,7 @@ void sr_handlepacket(struct sr_instance* sr,
 			minlength += sizeof(sr_ip_hdr_t);
 			if (len < minlength) {
 				fprintf(stderr, "Failed to parse IP header, insufficient length\n");
+				sr_stats_drop(sr_stats_drop_malformed);
 				return;
 			}
 
@@ -183,11 +245,13 @@ void sr_handlepacket(struct sr_instance* sr,
 			result = sr_checkIPchecksum(iphdr);
 			if (result) {
 				fprintf(stderr, "Failed to handle IP packet, incorrent IP checksum\n");
+				sr_stats_drop(sr_stats_drop_checksum);
 				return;
 			}
 
 			if (iphdr->ip_v != 4) {
 				fprintf(stderr, "Failed to parse IP header, version is not IPv4\n");
+				sr_stats_drop(sr_stats_drop_malformed);
 				return;
 			}
 
@@ -197,16 +261,28 @@ void sr_handlepacket(struct sr_instance* sr,
 				return;
 			}
 
-			if (sr_checkInterface(sr, iphdr->ip_dst)){
+			/* Filters on the way in come before anything else looks at it */
+			if (cur_interface->acl[sr_acl_in] &&
+			    sr_acl_match(cur_interface->acl[sr_acl_in], iphdr,
+					 len - sizeof(sr_ethernet_hdr_t)) == sr_acl_deny) {
+				sr_stats_drop(sr_stats_drop_filtered);
+				return;
+			}
+
+			if (sr_checkInterface(sr, iphdr->ip_dst) ||
+			    (sr->nat_enable && sr_nat_is_external(sr->nat, iphdr->ip_dst))){
 				/* If it's an ICMP protocol */
 
 				if (sr->nat_enable){
 					/*fprintf(stderr, "NAT enabled\n");*/
 					/* Some one send packet to NAT client*/
+					uint64_t start = sr_stats_clock();
 					if (strcmp(interface,sr->nat->ext_iface->name) == 0) {
 						sr_receiveNATpacket(sr, packet, len, interface);
+						sr_stats_latency(sr_stats_stage_nat_in, start);
 					} else if (strcmp(interface,sr->nat->int_iface->name) == 0) {
 						sr_sendNATpacket(sr, packet, len, interface);
+						sr_stats_latency(sr_stats_stage_nat_out, start);
 					}
 					return;
 				}
@@ -225,6 +301,7 @@ void sr_handlepacket(struct sr_instance* sr,
 					result = sr_checkICMPchecksum(icmphdr, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
 					if (result) {
 						fprintf(stderr, "Incorrent ICMP checksum for the ping to the router\n");
+						sr_stats_drop(sr_stats_drop_checksum);
 						return;
 					}
 
@@ -243,18 +320,21 @@ void sr_handlepacket(struct sr_instance* sr,
 				/* Do IP forwarding*/
 				/* Checking TTL*/
 				if (iphdr->ip_ttl == 1 || iphdr->ip_ttl == 0) {
+					sr_stats_drop(sr_stats_drop_ttl);
 					sr_sendICMPMsg(sr,11,0,interface,packet,len);
 					return;
 				}
 
-			
+				uint64_t start = sr_stats_clock();
 				if (sr->nat_enable) {
 					if (strcmp(interface,sr->nat->int_iface->name) == 0){
 						sr_sendNATpacket(sr, packet, len, interface);
+						sr_stats_latency(sr_stats_stage_nat_out, start);
 						return;
 					}
 				}
 				sr_handleIPforwarding(sr, packet, len, interface);
+				sr_stats_latency(sr_stats_stage_forward, start);
 				return;
 			}
 			break;
@@ -322,6 +402,11 @@ void sr_sendARPreply(struct sr_instance* sr,
 		new_arphdr->ar_tha[i] = arphdr->ar_sha[i];
 	}
 	new_arphdr->ar_sip = cur_interface->ip;
+	/* Answer for the NAT's pool addresses on the external side as well */
+	if (sr->nat_enable && strcmp(interface, sr->nat->ext_iface->name) == 0 &&
+	    sr_nat_is_external(sr->nat, arphdr->ar_tip)) {
+		new_arphdr->ar_sip = arphdr->ar_tip;
+	}
 	new_arphdr->ar_tip = arphdr->ar_sip;
 
 	sr_send_packet(sr, new_packet, sizeof (sr_ethernet_hdr_t) +
@@ -329,10 +414,10 @@ void sr_sendARPreply(struct sr_instance* sr,
 }
 
 /**
- * Send out ARP Request for the arp request
+ * Send out an ARP Request for ip on the interface, addressed to dhost
  */
-void sr_sendARPRequst(struct sr_instance* sr, struct sr_arpreq *req,
-		      char* interface)
+static void sr_sendARPRequestTo(struct sr_instance* sr, uint32_t ip,
+				const unsigned char *dhost, char* interface)
 {
 	uint8_t *new_packet = (uint8_t *) malloc(sizeof (sr_ethernet_hdr_t) +
 	sizeof (sr_arp_hdr_t));
@@ -343,12 +428,15 @@ void sr_sendARPRequst(struct sr_instance* sr, struct sr_arpreq *req,
 
 	/* setup ethhder */
 	struct sr_if* cur_interface =  sr_get_interface(sr, interface);
+	if (cur_interface == NULL) {
+		free(new_packet);
+		return;
+	}
 	int i;
 	for (i = 0; i < ETHER_ADDR_LEN; i++) {
 		/* Source is the interface mac address */
 		new_ethhdr->ether_shost[i] = (uint8_t) cur_interface->addr[i];
-		/* Destination is fffffff */
-		new_ethhdr->ether_dhost[i] = 0xff;
+		new_ethhdr->ether_dhost[i] = dhost[i];
 	}
 
 	new_ethhdr->ether_type = ntohs(ethertype_arp);
@@ -366,8 +454,31 @@ void sr_sendARPRequst(struct sr_instance* sr, struct sr_arpreq *req,
 	}
 
 	new_arphdr->ar_sip = cur_interface->ip;
-	new_arphdr->ar_tip = req->ip;
+	new_arphdr->ar_tip = ip;
 	sr_send_packet(sr, new_packet, sizeof (sr_ethernet_hdr_t) + sizeof (sr_arp_hdr_t), interface);
+	free(new_packet);
+}
+
+/**
+ * Send out ARP Request for the arp request
+ */
+void sr_sendARPRequst(struct sr_instance* sr, struct sr_arpreq *req,
+		      char* interface)
+{
+	/* Destination is fffffff */
+	static const unsigned char broadcast[ETHER_ADDR_LEN] =
+		{ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+	sr_sendARPRequestTo(sr, req->ip, broadcast, interface);
+}
+
+/**
+ * Send a unicast ARP Request to refresh a cache entry that is about to expire
+ */
+void sr_sendARPProbe(struct sr_instance* sr, uint32_t ip,
+		     unsigned char *mac, char* interface)
+{
+	sr_sendARPRequestTo(sr, ip, mac, interface);
 }
 
 /*
@@ -375,18 +486,19 @@ void sr_sendARPRequst(struct sr_instance* sr, struct sr_arpreq *req,
  */
 struct sr_rt *sr_findMatchInRoutingTable(struct sr_rt *rt_entry, uint32_t ip)
 {
+	sr_stats_count(sr_stats_lpm_lookup);
 	/* -------------- IP FORWARDING -----------------------------------------*/
 	/* Find out which entry in the routing table has the longest prefix match
 	 * with the destination IP address. - next-hop IP address*/
 	struct sr_rt* match_rt_entry = NULL;
 	while (rt_entry != NULL)
 	{
-		/* Use gateway ip to find the longest matching ip */
-		uint32_t cur_gw = *(uint32_t*) & rt_entry->gw;
+		/* Use the destination prefix to find the longest matching ip */
+		uint32_t cur_dest = *(uint32_t*) & rt_entry->dest;
 		uint32_t cur_mask = *(uint32_t*) & rt_entry->mask;
 
 		/* Find a match */
-		if ((cur_gw & cur_mask) == (cur_mask & ip))
+		if ((cur_dest & cur_mask) == (cur_mask & ip))
 		{
 			/* No previous match */
 			if (match_rt_entry == NULL) {
@@ -394,7 +506,7 @@ struct sr_rt *sr_findMatchInRoutingTable(struct sr_rt *rt_entry, uint32_t ip)
 				/* There is a previous match, get the match with the longer mask */
 			} else {
 				uint32_t match_mask = *(uint32_t*) & match_rt_entry->mask;
-				if (cur_mask > match_mask) {
+				if (ntohl(cur_mask) > ntohl(match_mask)) {
 					match_rt_entry = rt_entry;
 				}
 			}
@@ -404,6 +516,28 @@ struct sr_rt *sr_findMatchInRoutingTable(struct sr_rt *rt_entry, uint32_t ip)
 	return match_rt_entry;
 }
 
+/**
+ * Hash of a packet's flow, to spread flows over equal-cost next hops.
+ * Fragments are hashed without ports, which only the first one has, so
+ * that all of a datagram takes the same path.
+ */
+static uint32_t sr_flowhash(sr_ip_hdr_t *iphdr, unsigned int ip_len)
+{
+	uint32_t h = iphdr->ip_src ^ (iphdr->ip_dst * 0x9e3779b1) ^ iphdr->ip_p;
+	unsigned int hdr_len = iphdr->ip_hl * 4;
+
+	if ((iphdr->ip_p == ip_protocol_tcp || iphdr->ip_p == ip_protocol_udp) &&
+	    !sr_frag_is_fragment(iphdr) && ip_len >= hdr_len + 4) {
+		uint32_t ports;
+		memcpy(&ports, (uint8_t *) iphdr + hdr_len, sizeof(ports));
+		h ^= ports * 0x85ebca6b;
+	}
+	h ^= h >> 16;
+	h *= 0x7feb352d;
+	h ^= h >> 15;
+	return h;
+}
+
 /**
  * Handle IP forwarding:
  * packet:		packet to forward (ethernet)
@@ -428,16 +562,47 @@ void sr_handleIPforwarding(struct sr_instance* sr,
 	struct sr_rt *match_rt_entry = sr_findMatchInRoutingTable(sr->routing_table, iphdr->ip_dst);
 
 	if (match_rt_entry == NULL) {
+		sr_stats_drop(sr_stats_drop_no_route);
 		sr_sendICMPMsg(sr,3,0, interface, packet,len);
 		return;
 	}
-	struct sr_if *next_interface = sr_get_interface(sr, match_rt_entry->interface);
+	if (match_rt_entry->group) {
+		match_rt_entry = sr_rt_select(match_rt_entry,
+					      sr_flowhash(iphdr, len - sizeof(sr_ethernet_hdr_t)));
+	}
+	/* Resolve the outgoing interface once per route */
+	if (match_rt_entry->out_if == NULL) {
+		match_rt_entry->out_if = sr_get_interface(sr, match_rt_entry->interface);
+	}
+	struct sr_if *next_interface = match_rt_entry->out_if;
+	if (next_interface->acl[sr_acl_out] &&
+	    sr_acl_match(next_interface->acl[sr_acl_out], iphdr,
+			 len - sizeof(sr_ethernet_hdr_t)) == sr_acl_deny) {
+		sr_stats_drop(sr_stats_drop_filtered);
+		return;
+	}
+	/* Too big for the next link: fragment it on the way out, unless the
+	 * sender asked not to, in which case tell it the MTU (RFC 1191) */
+	if (len - sizeof(sr_ethernet_hdr_t) > next_interface->mtu &&
+	    (ntohs(iphdr->ip_off) & IP_DF)) {
+		sr_stats_drop(sr_stats_drop_df);
+		sr_sendICMPMsgMTU(sr, 3, 4, next_interface->mtu, interface, packet, len);
+		return;
+	}
 	/* Check the ARP cache for the next-hop MAC address corresponding
-	 * to the next-hop IP. - next-hop MAC address*/
+	 * to the next-hop IP: the route's gateway, or the destination itself
+	 * for connected routes. - next-hop MAC address*/
+	uint32_t next_hop_ip = sr_rt_nexthop(match_rt_entry, iphdr->ip_dst);
 	struct sr_arpentry *next_arp_entry;
-	next_arp_entry = sr_arpcache_lookup(&sr->cache, iphdr->ip_dst);
+	if (match_rt_entry->gw.s_addr) {
+		/* All traffic via a gateway shares its adjacency */
+		next_arp_entry = sr_arpcache_lookup_slot(&sr->cache, next_hop_ip, &match_rt_entry->adj);
+	} else {
+		next_arp_entry = sr_arpcache_lookup(&sr->cache, next_hop_ip);
+	}
 	/* If it's there, send it.*/
 	if (next_arp_entry != NULL) {
+		sr_stats_count(sr_stats_arp_hit);
 		/* put next hop mac in ethernet frame */
 		int i;
 		for (i = 0; i < ETHER_ADDR_LEN;i++){
@@ -445,21 +610,193 @@ void sr_handleIPforwarding(struct sr_instance* sr,
 			ehdr->ether_dhost[i] = next_arp_entry->mac[i];
 		}
 		/* send the packet */
-		sr_send_packet(sr, packet, len, match_rt_entry->interface);
+		sr_sendIPframe(sr, packet, len, next_interface);
 		/* Sending packet fails, free the pointer */
 		free((void *) next_arp_entry);
 	}else{
 		/* Otherwise, send an ARP request for the next-hop IP (if one
 		 * hasn't been sent within the last second), */
-		/* Send ARP Request for destinating ip */
+		/* Send ARP Request for the next hop */
+		sr_stats_count(sr_stats_arp_miss);
 		struct sr_arpreq *req;
-		req = sr_arpcache_queuereq(&sr->cache, iphdr->ip_dst, packet, len,
+		req = sr_arpcache_queuereq(&sr->cache, next_hop_ip, packet, len,
 					   next_interface->name);
 		sr_handle_arpreq(sr,req);
 	}
 	return;
 }
 
+/**
+ * Send an IP packet whose ethernet header is filled in out of out_if.
+ * A shaped interface queues it by class and flow and sends what its rate
+ * allows now; the rest goes out from sr_sched_timeout.
+ */
+int sr_sendIPframe(struct sr_instance* sr,
+		   uint8_t * packet/* lent */,
+		   unsigned int len,
+		   struct sr_if* out_if)
+{
+	if (out_if->sched == NULL) {
+		return sr_sendIPnow(sr, packet, len, out_if);
+	}
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
+	if (sr_sched_enqueue(out_if->sched, packet, len,
+			     sr_flowhash(iphdr, len - sizeof(sr_ethernet_hdr_t)), &now)) {
+		return -1;
+	}
+	sr_sched_drain(sr, out_if, &now);
+	return 0;
+}
+
+/**
+ * Send the queued packets of a shaped interface the rate allows at now.
+ */
+void sr_sched_drain(struct sr_instance* sr, struct sr_if* out_if,
+		    const struct timeval* now)
+{
+	struct sr_sched* sched = out_if->sched;
+	struct sr_sched_pkt* pkt;
+
+	pthread_mutex_lock(&(sched->drain));
+	while ((pkt = sr_sched_dequeue(sched, now)) != NULL) {
+		sr_sendIPnow(sr, pkt->buf, pkt->len, out_if);
+		sr_sched_pkt_free(pkt);
+	}
+	pthread_mutex_unlock(&(sched->drain));
+}
+
+/**
+ * Start the thread sending what shaped interfaces hold back, if any
+ * interface is shaped. Called once the interfaces are configured.
+ */
+void sr_sched_start(struct sr_instance* sr)
+{
+	struct sr_if* if_walker;
+	pthread_t thread;
+
+	for (if_walker = sr->if_list; if_walker; if_walker = if_walker->next) {
+		if (if_walker->sched) {
+			pthread_create(&thread, &(sr->attr), sr_sched_timeout, sr);
+			return;
+		}
+	}
+}
+
+/**
+ * Thread draining the queues of shaped interfaces as their token buckets
+ * refill.
+ */
+void *sr_sched_timeout(void *sr_ptr)
+{
+	struct sr_instance *sr = sr_ptr;
+	struct sr_if* if_walker;
+	struct timeval now;
+
+	while (1) {
+		usleep(SR_SCHED_TICK_US);
+		gettimeofday(&now, NULL);
+		for (if_walker = sr->if_list; if_walker; if_walker = if_walker->next) {
+			if (if_walker->sched) {
+				sr_sched_drain(sr, if_walker, &now);
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Keep only the options of an IP header that have the copied flag set,
+ * the ones RFC 791 has repeated in every fragment, padded to a 32 bit
+ * boundary. Rewrites the header in place and returns its new length.
+ */
+static unsigned int sr_copiedIPoptions(sr_ip_hdr_t *iphdr, unsigned int hdr_len)
+{
+	uint8_t *opt = (uint8_t *) iphdr;
+	unsigned int i = sizeof(sr_ip_hdr_t);
+	unsigned int out = sizeof(sr_ip_hdr_t);
+	unsigned int opt_len;
+
+	while (i < hdr_len && opt[i] != 0) {
+		if (opt[i] == 1) {
+			/* No-op padding, not copied */
+			i++;
+			continue;
+		}
+		if (i + 1 >= hdr_len || opt[i+1] < 2 || i + opt[i+1] > hdr_len) {
+			break;
+		}
+		opt_len = opt[i+1];
+		if (opt[i] & 0x80) {
+			memmove(opt + out, opt + i, opt_len);
+			out += opt_len;
+		}
+		i += opt_len;
+	}
+	while (out & 3) {
+		opt[out++] = 0;
+	}
+	iphdr->ip_hl = out / 4;
+	return out;
+}
+
+/**
+ * Send an IP packet whose ethernet header is filled in out of out_if,
+ * splitting it into fragments if it is larger than the interface MTU.
+ * Each fragment is sent as a new header followed by its slice of the
+ * original payload, so the payload is never copied.
+ */
+static int sr_sendIPnow(struct sr_instance* sr,
+			uint8_t * packet/* lent */,
+			unsigned int len,
+			struct sr_if* out_if)
+{
+	if (len - sizeof(sr_ethernet_hdr_t) <= out_if->mtu) {
+		return sr_send_packet(sr, packet, len, out_if->name);
+	}
+
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
+	unsigned int hdr_len = iphdr->ip_hl * 4;
+	unsigned int ip_len = ntohs(iphdr->ip_len);
+	if (hdr_len < sizeof(sr_ip_hdr_t) || ip_len < hdr_len ||
+	    ip_len > len - sizeof(sr_ethernet_hdr_t) || out_if->mtu < hdr_len + 8) {
+		fprintf(stderr, "Failed to fragment IP packet\n");
+		return -1;
+	}
+	unsigned int payload = ip_len - hdr_len;
+	unsigned int frag_hdr_len = hdr_len;
+	unsigned int chunk_max = (out_if->mtu - frag_hdr_len) & ~7u;
+	uint16_t off = ntohs(iphdr->ip_off);
+
+	/* Ethernet and IP header of each fragment; the first carries all the
+	 * options, the rest only the copied ones */
+	uint8_t hdr[sizeof(sr_ethernet_hdr_t) + 60];
+	sr_ip_hdr_t *frag_iphdr = (sr_ip_hdr_t*) (hdr + sizeof(sr_ethernet_hdr_t));
+	memcpy(hdr, packet, sizeof(sr_ethernet_hdr_t) + hdr_len);
+
+	unsigned int pos, chunk;
+	for (pos = 0; pos < payload; pos += chunk) {
+		chunk = payload - pos < chunk_max ? payload - pos : chunk_max;
+		frag_iphdr->ip_len = htons(frag_hdr_len + chunk);
+		/* A fragment of a fragment keeps the original's MF on its tail */
+		frag_iphdr->ip_off = htons(((off & IP_OFFMASK) + pos / 8) |
+					   ((pos + chunk < payload || (off & IP_MF)) ? IP_MF : 0));
+		frag_iphdr->ip_sum = 0;
+		frag_iphdr->ip_sum = cksum(frag_iphdr, frag_hdr_len);
+		if (sr_send_packetv(sr, hdr, sizeof(sr_ethernet_hdr_t) + frag_hdr_len,
+				    packet + sizeof(sr_ethernet_hdr_t) + hdr_len + pos,
+				    chunk, out_if->name)) {
+			return -1;
+		}
+		if (pos == 0 && frag_hdr_len > sizeof(sr_ip_hdr_t)) {
+			frag_hdr_len = sr_copiedIPoptions(frag_iphdr, frag_hdr_len);
+			chunk_max = (out_if->mtu - frag_hdr_len) & ~7u;
+		}
+	}
+	return 0;
+}
+
 /**
  * Check if the checksum in IP header is correct; Return 0 if it's correct and 1 otherwise.
  */
@@ -514,7 +851,11 @@ void sr_handle_arpreq(struct sr_instance* sr, struct sr_arpreq *req) {
 		if (req->times_sent >= 5){
 			struct sr_packet *pkt = req->packets;
 
+			/* Move flows off an equal-cost next hop that is gone */
+			sr_rt_set_down(sr, req->ip, 1);
+
 			while (pkt != NULL){
+				sr_stats_drop(sr_stats_drop_unreachable);
 				/* Host unreachable: Do not send ICMP message for ICMP Error Message */
 				sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *) pkt->buf;
 				sr_ip_hdr_t *iphdr = (sr_ip_hdr_t*) (pkt->buf + sizeof(sr_ethernet_hdr_t));
@@ -533,6 +874,10 @@ void sr_handle_arpreq(struct sr_instance* sr, struct sr_arpreq *req) {
 				}
 
 				/* Make a new ethernet packet with ICMP for IP forwarding */
+				if (!sr_icmp_allow(sr, 3, iphdr->ip_src)) {
+					pkt = pkt->next;
+					continue;
+				}
 
 				struct sr_rt *entry = sr_findMatchInRoutingTable(sr->routing_table, iphdr->ip_src);
 
@@ -589,7 +934,8 @@ void sr_handleARPReply(struct sr_instance* sr,
 {	
 	struct sr_arpreq *req = NULL;
 
-	req = sr_arpcache_insert(&sr->cache, arphdr->ar_sha, arphdr->ar_sip);
+	req = sr_arpcache_insert(&sr->cache, arphdr->ar_sha, arphdr->ar_sip, interface);
+	sr_rt_set_down(sr, arphdr->ar_sip, 0);
 
 	if (req != NULL) {
 		struct sr_packet *pkts = req->packets;
@@ -611,7 +957,7 @@ void sr_handleARPReply(struct sr_instance* sr,
 				return;
 			}
 
-			sr_send_packet(sr, pkts->buf, pkts->len, pkts->iface);
+			sr_sendIPframe(sr, pkts->buf, pkts->len, pkt_interface);
 			pkts = pkts->next;
 		}
 		sr_arpreq_destroy(&sr->cache, req);
@@ -629,6 +975,10 @@ void sr_sendICMPPingRep(struct sr_instance *sr,
 {
 	sr_ethernet_hdr_t *new_ethhdr = (sr_ethernet_hdr_t *) packet;
 	sr_ip_hdr_t *new_iphdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+
+	if (!sr_icmp_allow(sr, 0, new_iphdr->ip_src)) {
+		return;
+	}
 	sr_icmp_hdr_t *new_icmphdr = (sr_icmp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
 
 	struct sr_if* cur_interface =  sr_get_interface(sr, interface);
@@ -653,10 +1003,31 @@ void sr_sendICMPMsg(struct sr_instance * sr,
 		    char * interface,
 		    uint8_t * old_packet,
 		    unsigned int len)
+{
+	sr_sendICMPMsgMTU(sr, icmp_type, icmp_code, 0, interface, old_packet, len);
+}
+
+/*
+ * As sr_sendICMPMsg, with the next-hop MTU field of a fragmentation
+ * needed message (type 3 code 4) set.
+ */
+void sr_sendICMPMsgMTU(struct sr_instance * sr,
+		    uint8_t icmp_type,
+		    uint8_t icmp_code,
+		    uint16_t next_mtu,
+		    char * interface,
+		    uint8_t * old_packet,
+		    unsigned int len)
 {	
 	/* The ICMP error msg has the following structure: */
 	/* |eth header| ip header | icmp header | old ip header | first 8 bytes of payload | */
 
+	/* Decide before building anything */
+	if (!sr_icmp_allow(sr, icmp_type,
+			   ((sr_ip_hdr_t *) (old_packet + sizeof(sr_ethernet_hdr_t)))->ip_src)) {
+		return;
+	}
+
 	uint8_t *new_packet = (uint8_t *) malloc(sizeof (sr_ethernet_hdr_t) + sizeof (sr_ip_hdr_t) +  sizeof(sr_icmp_t3_hdr_t));
 
 	sr_ethernet_hdr_t *new_ethhdr = (sr_ethernet_hdr_t *) new_packet;
@@ -682,6 +1053,11 @@ void sr_sendICMPMsg(struct sr_instance * sr,
 	/* Copy the old ip header */
 	memcpy(new_icmphdr->data, old_packet + sizeof(sr_ethernet_hdr_t), ICMP_DATA_SIZE);
 	setICMPHeader(new_icmphdr, icmp_type, icmp_code);
+	if (next_mtu) {
+		new_icmphdr->next_mtu = htons(next_mtu);
+		new_icmphdr->icmp_sum = 0;
+		new_icmphdr->icmp_sum = cksum(new_icmphdr, sizeof(sr_icmp_t3_hdr_t));
+	}
 
 	sr_send_packet(sr, new_packet, sizeof (sr_ethernet_hdr_t) +
 	sizeof (sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t), interface);
@@ -689,6 +1065,49 @@ void sr_sendICMPMsg(struct sr_instance * sr,
 	return;
 }
 
+/*
+ * Whether the router may send an ICMP message of type to dst now, taking
+ * a token from the type's and the destination's buckets if so.
+ */
+int sr_icmp_allow(struct sr_instance* sr, uint8_t type, uint32_t dst)
+{
+	struct sr_icmp_limit *limit = &sr->icmp_limit;
+	uint32_t h = dst * 0x9e3779b1;
+	struct sr_token_bucket *source = &limit->sources[(h >> 16) & (SR_ICMP_SOURCES - 1)];
+	struct timeval now;
+	int allowed;
+
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&(limit->lock));
+	/* Take from neither unless both have a token */
+	allowed = sr_tb_has(source, 1, &now) &&
+		  sr_tb_has(&limit->types[type], 1, &now);
+	if (allowed) {
+		sr_tb_take(source, 1, &now);
+		sr_tb_take(&limit->types[type], 1, &now);
+	} else {
+		limit->suppressed[type]++;
+	}
+	pthread_mutex_unlock(&(limit->lock));
+	if (allowed) {
+		sr_stats_icmp(type);
+	} else {
+		sr_stats_drop(sr_stats_drop_icmp_limit);
+	}
+	return allowed;
+}
+
+void sr_icmp_limit_dump(struct sr_instance* sr)
+{
+	int i;
+	for (i = 0; i < 256; i++) {
+		if (sr->icmp_limit.suppressed[i]) {
+			fprintf(stderr, "ICMP type %d suppressed: %lu\n", i,
+				sr->icmp_limit.suppressed[i]);
+		}
+	}
+}
+
 /*
  * Return 1 if the interface is one of the router's, 0 otherwise.
  */
@@ -792,6 +1211,8 @@ sr_sendNATpacket(struct sr_instance* sr,
 	/*printf("Send NAT\n");*/
 
 	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
+	sr_ip_hdr_t first_frag;
+	int is_first_frag = 0;
 
 	if (sr->nat_enable && (strcmp(interface,"eth1") == 0)){
 		/* from internal interface */
@@ -799,6 +1220,15 @@ sr_sendNATpacket(struct sr_instance* sr,
 		struct sr_nat_mapping *tmp;
 		sr_nat_mapping_type packet_type;
 
+		if (sr_frag_is_fragment(iphdr)) {
+			if (sr_handleNATfragment(sr, packet, len, interface, sr_sendNATpacket)) {
+				return;
+			}
+			/* First fragment: translated below by its transport header */
+			memcpy(&first_frag, iphdr, sizeof(sr_ip_hdr_t));
+			is_first_frag = 1;
+		}
+
 		/*print_hdrs(packet,len);*/
 
 		switch (iphdr->ip_p){
@@ -818,18 +1248,23 @@ sr_sendNATpacket(struct sr_instance* sr,
 					}
 				}
 
-				tmp = sr_nat_lookup_internal(sr->nat,iphdr->ip_src,icmphdr->icmp_id,packet_type);
+				tmp = sr_nat_lookup_internal(sr->nat,iphdr->ip_src,icmphdr->icmp_id,iphdr->ip_dst,0,packet_type);
 				if (tmp == NULL){
-					tmp = sr_nat_insert_mapping(sr->nat,iphdr->ip_src,icmphdr->icmp_id,packet_type);
+					tmp = sr_nat_insert_mapping(sr->nat,iphdr->ip_src,icmphdr->icmp_id,iphdr->ip_dst,0,packet_type);
+					if (tmp == NULL) {
+						/* Out of mapping records, drop */
+						sr_stats_drop(sr_stats_drop_nat);
+						return;
+					}
 				} else {
 					sr_nat_refresh_mapping_time(sr->nat, tmp);
 				}
-				iphdr->ip_src = sr->nat->ext_iface->ip;
+				iphdr->ip_src = tmp->ip_ext;
+				/* Patched rather than recomputed, since a first fragment
+				 * does not hold the whole message */
+				icmphdr->icmp_sum = cksum_update16(icmphdr->icmp_sum, icmphdr->icmp_id, tmp->aux_ext);
 				icmphdr->icmp_id = tmp->aux_ext;
 
-				icmphdr->icmp_sum = 0;
-				icmphdr->icmp_sum = cksum(icmphdr, len-sizeof(sr_ethernet_hdr_t)-sizeof(sr_ip_hdr_t));
-
 				free(tmp);
 				break;
 			case ip_protocol_tcp:
@@ -837,69 +1272,305 @@ sr_sendNATpacket(struct sr_instance* sr,
 				packet_type = nat_mapping_tcp;
 
 				sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-				tmp = sr_nat_lookup_internal(sr->nat,iphdr->ip_src,tcphdr->th_sport,packet_type);
+				tmp = sr_nat_lookup_internal(sr->nat,iphdr->ip_src,tcphdr->th_sport,iphdr->ip_dst,tcphdr->th_dport,packet_type);
 
 				if (tmp == NULL){
-					tmp = sr_nat_insert_mapping(sr->nat,iphdr->ip_src,tcphdr->th_sport,packet_type);
+					tmp = sr_nat_insert_mapping(sr->nat,iphdr->ip_src,tcphdr->th_sport,iphdr->ip_dst,tcphdr->th_dport,packet_type);
+					if (tmp == NULL) {
+						/* Out of mapping records, drop */
+						sr_stats_drop(sr_stats_drop_nat);
+						return;
+					}
 				} else {
 					sr_nat_refresh_mapping_time(sr->nat, tmp);
 				}
 
-				/* look up connection*/
-				/* free con later */
-				struct sr_nat_connection *con = sr_nat_lookup_connection(sr->nat, tmp, iphdr->ip_src, tcphdr->th_sport, iphdr->ip_dst, tcphdr->th_dport);
-
-				if (con){
-					/* check con state */
-					if (con->established == 1){
-						/* forward */
-
-					} else if (con->established == 0) {
-						/* check if is SYN ACK */
-						if ((tcphdr->th_flags & TH_SYN == 1) && (tcphdr->th_flags & TH_ACK == 1)){
-							if (con->isn_src + 1 == tcphdr->th_ack){
-								sr_update_isn(sr->nat, tmp, con, con->isn_src, tcphdr->th_seq);
-							}
-						} else if ((tcphdr->th_flags & TH_SYN == 0) && (tcphdr->th_flags & TH_ACK == 1)){
-							if(con->isn_dst + 1 == tcphdr->th_ack){
-								/* change to establish state*/
-								sr_nat_establish_connection(sr->nat, tmp, con);
-							}
-						}
-						/* otherwies forward */
-					} else {
-						/* connection is -1 */
-						if ((tcphdr->th_flags & TH_SYN == 1) && (tcphdr->th_flags & TH_ACK == 0)){
-							sr_nat_establish_connection(sr->nat, tmp, con);
-						}
-					}
+				/* Track the connection state */
+				if (sr_nat_tcp_track(sr->nat, tmp, iphdr->ip_dst, tcphdr->th_dport, tcphdr->th_flags, 1, NULL, 0)) {
+					free(tmp);
+					return;
+				}
 
-					sr_nat_refresh_connection_time(sr->nat, tmp, con);
-				} else {
-					/* check if SYN */
-					if ((tcphdr->th_flags & TH_SYN == 1) && (tcphdr->th_flags & TH_ACK == 0)){
-						sr_nat_add_connection(sr->nat, tmp, iphdr->ip_src, tcphdr->th_sport, iphdr->ip_dst, tcphdr->th_dport, tcphdr->th_seq, 0, NULL, 0);
-					} else {
-						/* DO STH */
-					}
+				tcphdr->th_sum = cksum_update32(tcphdr->th_sum, iphdr->ip_src, tmp->ip_ext);
+				tcphdr->th_sum = cksum_update16(tcphdr->th_sum, tcphdr->th_sport, htons(tmp->aux_ext));
+				iphdr->ip_src = tmp->ip_ext;
+				tcphdr->th_sport = htons(tmp->aux_ext);
+				/* A hairpinned SYN is clamped for the internal side, by
+				 * sr_hairpinNATpacket */
+				if (!sr_nat_is_external(sr->nat, iphdr->ip_dst)) {
+					sr_clampTCPMSS(tcphdr, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t), sr->nat->ext_iface);
 				}
 
+				free(tmp);
+				break;
+			case ip_protocol_udp:
+				/* UDP */
+				packet_type = nat_mapping_udp;
+				if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_udp_hdr_t)) {
+					fprintf(stderr, "Failed to parse UDP header, insufficient length\n");
+					return;
+				}
 
-				iphdr->ip_src = sr->nat->ext_iface->ip;
-				tcphdr->th_sport = htons(tmp->aux_ext);
+				sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+				tmp = sr_nat_lookup_internal(sr->nat,iphdr->ip_src,udphdr->uh_sport,iphdr->ip_dst,udphdr->uh_dport,packet_type);
 
-				tcphdr->th_sum = 0;
-				tcphdr->th_sum = sr_get_tcp_cksum(packet, len);
+				if (tmp == NULL){
+					tmp = sr_nat_insert_mapping(sr->nat,iphdr->ip_src,udphdr->uh_sport,iphdr->ip_dst,udphdr->uh_dport,packet_type);
+					if (tmp == NULL) {
+						/* Out of mapping records, drop */
+						sr_stats_drop(sr_stats_drop_nat);
+						return;
+					}
+				} else {
+					sr_nat_refresh_mapping_time(sr->nat, tmp);
+				}
+
+				/* Patch the checksum for the new source instead of recomputing
+				 * it over the payload; zero means the sender sent none. */
+				if (udphdr->uh_sum) {
+					uint16_t sum = cksum_update32(udphdr->uh_sum, iphdr->ip_src, tmp->ip_ext);
+					sum = cksum_update16(sum, udphdr->uh_sport, htons(tmp->aux_ext));
+					udphdr->uh_sum = sum ? sum : 0xffff;
+				}
+				iphdr->ip_src = tmp->ip_ext;
+				udphdr->uh_sport = htons(tmp->aux_ext);
 
+				free(tmp);
 				break;
 		}
 	}
+	/* Addressed to one of our own mappings: turn it around inside */
+	if (sr->nat_enable && sr_nat_is_external(sr->nat, iphdr->ip_dst)) {
+		sr_hairpinNATpacket(sr, packet, len, interface,
+				    is_first_frag ? &first_frag : NULL);
+		return;
+	}
 	/*print_hdrs(packet,len);*/
+	if (is_first_frag) {
+		sr_forwardNATfirstfragment(sr, &first_frag, packet, len, interface);
+		return;
+	}
 	sr_handleIPforwarding(sr, packet, len, interface);
 
 	return;
 }
 
+/*
+ * Hairpinning (RFC 4787 REQ-9): an internal packet, its source already
+ * translated, sent to an external mapping of another internal host. The
+ * destination is translated as if the packet had come in from outside,
+ * and the packet goes straight back out of the internal interface.
+ * first_frag is the original header of a first fragment, or NULL.
+ */
+void
+sr_hairpinNATpacket(struct sr_instance* sr,
+			   uint8_t * packet/* lent */,
+			   unsigned int len,
+			   char* interface/* lent */,
+			   sr_ip_hdr_t *first_frag)
+{
+	sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *) packet;
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
+	struct sr_nat_mapping *tmp;
+
+	/* Addressed to the NAT, so sr_handlepacket hasn't checked TTL; it is
+	 * forwarded all the same, and answered untranslated like forwarding */
+	if (iphdr->ip_ttl == 1 || iphdr->ip_ttl == 0) {
+		sr_stats_drop(sr_stats_drop_ttl);
+		sr_sendICMPMsg(sr, 11, 0, interface, packet, len);
+		return;
+	}
+
+	switch (iphdr->ip_p){
+		case ip_protocol_tcp:
+			if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t)) {
+				return;
+			}
+			sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+			tmp = sr_nat_lookup_external(sr->nat,iphdr->ip_dst,ntohs(tcphdr->th_dport),iphdr->ip_src,tcphdr->th_sport,nat_mapping_tcp);
+			if (tmp == NULL) {
+				sr_stats_drop(sr_stats_drop_nat);
+				return;
+			}
+			sr_nat_refresh_mapping_time(sr->nat, tmp);
+			if (sr_nat_tcp_track(sr->nat, tmp, iphdr->ip_src, tcphdr->th_sport, tcphdr->th_flags, 0, packet, len)) {
+				free(tmp);
+				return;
+			}
+			tcphdr->th_sum = cksum_update32(tcphdr->th_sum, iphdr->ip_dst, tmp->ip_int);
+			tcphdr->th_sum = cksum_update16(tcphdr->th_sum, tcphdr->th_dport, tmp->aux_int);
+			iphdr->ip_dst = tmp->ip_int;
+			tcphdr->th_dport = tmp->aux_int;
+			sr_clampTCPMSS(tcphdr, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t), sr->nat->int_iface);
+			free(tmp);
+			break;
+		case ip_protocol_udp:
+			if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_udp_hdr_t)) {
+				return;
+			}
+			sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+			tmp = sr_nat_lookup_external(sr->nat,iphdr->ip_dst,ntohs(udphdr->uh_dport),iphdr->ip_src,udphdr->uh_sport,nat_mapping_udp);
+			if (tmp == NULL) {
+				sr_stats_drop(sr_stats_drop_nat);
+				return;
+			}
+			sr_nat_refresh_mapping_time(sr->nat, tmp);
+			if (udphdr->uh_sum) {
+				uint16_t sum = cksum_update32(udphdr->uh_sum, iphdr->ip_dst, tmp->ip_int);
+				sum = cksum_update16(sum, udphdr->uh_dport, tmp->aux_int);
+				udphdr->uh_sum = sum ? sum : 0xffff;
+			}
+			iphdr->ip_dst = tmp->ip_int;
+			udphdr->uh_dport = tmp->aux_int;
+			free(tmp);
+			break;
+		default:
+			/* Only TCP and UDP mappings can be reached from inside */
+			return;
+	}
+
+	if (first_frag) {
+		/* Record both translations for the fragments that follow */
+		sr_forwardNATfirstfragment(sr, first_frag, packet, len, interface);
+		return;
+	}
+
+	/* The destination is on the internal interface: skip the route
+	 * lookup when its MAC is known */
+	struct sr_arpentry *arp_entry = sr_arpcache_lookup(&sr->cache, iphdr->ip_dst);
+	if (arp_entry == NULL) {
+		sr_handleIPforwarding(sr, packet, len, interface);
+		return;
+	}
+	if (len - sizeof(sr_ethernet_hdr_t) > sr->nat->int_iface->mtu) {
+		/* Let forwarding fragment it or report the MTU */
+		free(arp_entry);
+		sr_handleIPforwarding(sr, packet, len, interface);
+		return;
+	}
+	struct sr_if *out_if = sr->nat->int_iface;
+	if (out_if->acl[sr_acl_out] &&
+	    sr_acl_match(out_if->acl[sr_acl_out], iphdr,
+			 len - sizeof(sr_ethernet_hdr_t)) == sr_acl_deny) {
+		sr_stats_drop(sr_stats_drop_filtered);
+		free(arp_entry);
+		return;
+	}
+	iphdr->ip_ttl = iphdr->ip_ttl - 1;
+	iphdr->ip_sum = 0;
+	iphdr->ip_sum = cksum(iphdr, sizeof(sr_ip_hdr_t));
+
+	int i;
+	for (i = 0; i < ETHER_ADDR_LEN; i++){
+		ehdr->ether_shost[i] = out_if->addr[i];
+		ehdr->ether_dhost[i] = arp_entry->mac[i];
+	}
+	sr_sendIPframe(sr, packet, len, out_if);
+	free(arp_entry);
+}
+
+/*
+ * An ICMP error from outside about a translated packet. The quoted IP
+ * header and first 8 bytes carry the external source (ip, port or ICMP
+ * id) of the mapping; the error is translated back to the internal host,
+ * quoted headers included, and forwarded inside.
+ */
+void
+sr_receiveNATerror(struct sr_instance* sr,
+			   uint8_t * packet/* lent */,
+			   unsigned int len,
+			   char* interface/* lent */)
+{
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
+	sr_icmp_t3_hdr_t *icmphdr = (sr_icmp_t3_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+	unsigned int icmp_len = len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t);
+
+	/* The quoted IP header follows the first 8 bytes of the ICMP header */
+	unsigned int quote_off = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + 8;
+	if (len < quote_off + sizeof(sr_ip_hdr_t) + 8) {
+		return;
+	}
+	sr_ip_hdr_t *inner = (sr_ip_hdr_t *) (packet + quote_off);
+	unsigned int inner_hl = inner->ip_hl * 4;
+	if (inner_hl < sizeof(sr_ip_hdr_t) || len < quote_off + inner_hl + 8) {
+		return;
+	}
+	uint8_t *l4 = (uint8_t *) inner + inner_hl;
+	unsigned int l4_len = len - quote_off - inner_hl;
+
+	/* Offsets into the quoted transport header of the source port or
+	 * ICMP id and of the checksum, if it was quoted */
+	sr_nat_mapping_type packet_type;
+	unsigned int aux_off;
+	unsigned int sum_off = 0;
+	uint16_t port_remote = 0;
+	switch (inner->ip_p){
+		case ip_protocol_tcp:
+			packet_type = nat_mapping_tcp;
+			aux_off = offsetof(sr_tcp_hdr_t, th_sport);
+			port_remote = ((sr_tcp_hdr_t *) l4)->th_dport;
+			/* Usually cut off: only 8 bytes are required */
+			if (l4_len >= offsetof(sr_tcp_hdr_t, th_sum) + 2) {
+				sum_off = offsetof(sr_tcp_hdr_t, th_sum);
+			}
+			break;
+		case ip_protocol_udp:
+			packet_type = nat_mapping_udp;
+			aux_off = offsetof(sr_udp_hdr_t, uh_sport);
+			port_remote = ((sr_udp_hdr_t *) l4)->uh_dport;
+			if (((sr_udp_hdr_t *) l4)->uh_sum) {
+				sum_off = offsetof(sr_udp_hdr_t, uh_sum);
+			}
+			break;
+		case ip_protocol_icmp:
+			packet_type = nat_mapping_icmp;
+			aux_off = offsetof(sr_icmp_hdr_t, icmp_id);
+			sum_off = offsetof(sr_icmp_hdr_t, icmp_sum);
+			break;
+		default:
+			return;
+	}
+
+	uint16_t aux;
+	memcpy(&aux, l4 + aux_off, sizeof(aux));
+	uint16_t aux_ext = (packet_type == nat_mapping_icmp) ? aux : ntohs(aux);
+	struct sr_nat_mapping *tmp = sr_nat_lookup_external(sr->nat, inner->ip_src, aux_ext,
+							    inner->ip_dst, port_remote, packet_type);
+	if (tmp == NULL) {
+		/* Never answer an error with another */
+		return;
+	}
+
+	/* Quoted transport header: the pseudo header (TCP/UDP only) and the
+	 * port or id change */
+	if (sum_off) {
+		uint16_t sum;
+		memcpy(&sum, l4 + sum_off, sizeof(sum));
+		if (packet_type != nat_mapping_icmp) {
+			sum = cksum_update32(sum, inner->ip_src, tmp->ip_int);
+		}
+		sum = cksum_update16(sum, aux, tmp->aux_int);
+		if (packet_type == nat_mapping_udp && sum == 0) {
+			sum = 0xffff;
+		}
+		memcpy(l4 + sum_off, &sum, sizeof(sum));
+	}
+	memcpy(l4 + aux_off, &tmp->aux_int, sizeof(tmp->aux_int));
+
+	/* Quoted IP header */
+	inner->ip_src = tmp->ip_int;
+	inner->ip_sum = 0;
+	inner->ip_sum = cksum(inner, inner_hl);
+
+	/* Outer headers; forwarding redoes the IP checksum */
+	iphdr->ip_dst = tmp->ip_int;
+	icmphdr->icmp_sum = 0;
+	icmphdr->icmp_sum = cksum(icmphdr, icmp_len);
+	free(tmp);
+
+	sr_handleIPforwarding(sr, packet, len, interface);
+}
+
 void
 sr_receiveNATpacket(struct sr_instance* sr,
 			   uint8_t * packet/* lent */,
@@ -912,17 +1583,35 @@ sr_receiveNATpacket(struct sr_instance* sr,
 	print_hdrs(packet, len);*/
 	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
 
+	sr_ip_hdr_t first_frag;
+	int is_first_frag = 0;
+
 	/* If the packet comes from external interface */
 	if (sr->nat_enable &&  (strcmp(interface,sr->nat->ext_iface->name) == 0)){
 		/* from external interface */
 		struct sr_nat_mapping *tmp;
 		sr_nat_mapping_type packet_type;
+
+		if (sr_frag_is_fragment(iphdr)) {
+			if (sr_handleNATfragment(sr, packet, len, interface, sr_receiveNATpacket)) {
+				return;
+			}
+			memcpy(&first_frag, iphdr, sizeof(sr_ip_hdr_t));
+			is_first_frag = 1;
+		}
 		switch (iphdr->ip_p){
 			case ip_protocol_icmp:
 				/* ICMP */
 				packet_type = nat_mapping_icmp;
 				sr_icmp_hdr_t *icmphdr = (sr_icmp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
 
+				/* Errors quote the packet they are about: translate by that */
+				if (icmphdr->icmp_type == 3 || icmphdr->icmp_type == 4 ||
+				    icmphdr->icmp_type == 11 || icmphdr->icmp_type == 12) {
+					sr_receiveNATerror(sr, packet, len, interface);
+					return;
+				}
+
 				/* Check if it is an ICMP ping request */
 				if (icmphdr->icmp_code == 0 && icmphdr->icmp_type == 8) {
 					/* If want to ping internal interface, then drop it */
@@ -934,8 +1623,9 @@ sr_receiveNATpacket(struct sr_instance* sr,
 					}
 				}
 
-				tmp = sr_nat_lookup_external(sr->nat,icmphdr->icmp_id,packet_type);
+				tmp = sr_nat_lookup_external(sr->nat,iphdr->ip_dst,icmphdr->icmp_id,iphdr->ip_src,0,packet_type);
 				if (tmp == NULL){
+					sr_stats_drop(sr_stats_drop_nat);
 					sr_sendICMPMsg(sr, 3, 1, interface, packet, len);
 					return;
 				} else {
@@ -944,9 +1634,8 @@ sr_receiveNATpacket(struct sr_instance* sr,
 				iphdr->ip_src = sr->nat->int_iface->ip;
 				iphdr->ip_dst = tmp->ip_int;
 
+				icmphdr->icmp_sum = cksum_update16(icmphdr->icmp_sum, icmphdr->icmp_id, tmp->aux_int);
 				icmphdr->icmp_id = tmp->aux_int;
-				icmphdr->icmp_sum = 0;
-				icmphdr->icmp_sum = cksum(icmphdr, len-sizeof(sr_ethernet_hdr_t)-sizeof(sr_ip_hdr_t));
 				free(tmp);
 				break;
 			case ip_protocol_tcp:
@@ -955,61 +1644,181 @@ sr_receiveNATpacket(struct sr_instance* sr,
 
 				sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
 
-				tmp = sr_nat_lookup_external(sr->nat,ntohs(tcphdr->th_dport),packet_type);
+				tmp = sr_nat_lookup_external(sr->nat,iphdr->ip_dst,ntohs(tcphdr->th_dport),iphdr->ip_src,tcphdr->th_sport,packet_type);
 
 				if (tmp == NULL){
+					sr_stats_drop(sr_stats_drop_nat);
 					sr_sendICMPMsg(sr, 3, 1, interface, packet, len);
 					return;
 				} else {
 					sr_nat_refresh_mapping_time(sr->nat, tmp);
 				}
 
-				/* look up connection*/
-				/* free con later */
-				struct sr_nat_connection *con = sr_nat_lookup_connection(sr->nat, tmp, tmp->ip_int, tmp->aux_int, iphdr->ip_src, tcphdr->th_sport);
-
-				if (con){
-					/* check con state */
-					if (con->established){
-						/* forward */
-
-					}else{
-						/* check if is SYN ACK */
-						if ((tcphdr->th_flags & TH_SYN == 1) && (tcphdr->th_flags & TH_ACK == 1)){
-							if (con->isn_src + 1 == tcphdr->th_ack){
-								sr_update_isn(sr->nat, tmp, con, con->isn_src, tcphdr->th_seq);
-							}
-						} else if ((tcphdr->th_flags & TH_SYN == 0) && (tcphdr->th_flags & TH_ACK == 1)){
-							if(con->isn_dst + 1 == tcphdr->th_ack){
-								/* change to establish state*/
-								sr_nat_establish_connection(sr->nat, tmp, con);
-							}
-						}
-						/* otherwies forward */
-					}
-					sr_nat_refresh_connection_time(sr->nat, tmp, con);
-				} else {
-					/* check if SYN */
-					if ((tcphdr->th_flags & TH_SYN == 1) && (tcphdr->th_flags & TH_ACK == 0)){
-						/* Make the established to be -1: timeout after 6s if no new client outbound exits */
-						sr_nat_add_connection(sr->nat, tmp, iphdr->ip_src, tcphdr->th_sport, iphdr->ip_dst, tcphdr->th_dport, tcphdr->th_seq, -1, packet, len);
-					} else {
-						/* DO STH */
-					}
+				/* Track the connection state; an unsolicited SYN is kept
+				 * for the ICMP error sent if nobody inside answers */
+				if (sr_nat_tcp_track(sr->nat, tmp, iphdr->ip_src, tcphdr->th_sport, tcphdr->th_flags, 0, packet, len)) {
+					free(tmp);
+					return;
 				}
 
+				tcphdr->th_sum = cksum_update32(tcphdr->th_sum, iphdr->ip_dst, tmp->ip_int);
+				tcphdr->th_sum = cksum_update16(tcphdr->th_sum, tcphdr->th_dport, tmp->aux_int);
 				iphdr->ip_dst = tmp->ip_int;
 				tcphdr->th_dport = tmp->aux_int;
-				tcphdr->th_sum = 0;
-				tcphdr->th_sum = sr_get_tcp_cksum(packet, len);
+				sr_clampTCPMSS(tcphdr, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t), sr->nat->int_iface);
+				free(tmp);
+				break;
+			case ip_protocol_udp:
+				/* UDP */
+				packet_type = nat_mapping_udp;
+				if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_udp_hdr_t)) {
+					fprintf(stderr, "Failed to parse UDP header, insufficient length\n");
+					return;
+				}
+
+				sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+				tmp = sr_nat_lookup_external(sr->nat,iphdr->ip_dst,ntohs(udphdr->uh_dport),iphdr->ip_src,udphdr->uh_sport,packet_type);
+
+				if (tmp == NULL){
+					sr_stats_drop(sr_stats_drop_nat);
+					sr_sendICMPMsg(sr, 3, 3, interface, packet, len);
+					return;
+				} else {
+					sr_nat_refresh_mapping_time(sr->nat, tmp);
+				}
+
+				if (udphdr->uh_sum) {
+					uint16_t sum = cksum_update32(udphdr->uh_sum, iphdr->ip_dst, tmp->ip_int);
+					sum = cksum_update16(sum, udphdr->uh_dport, tmp->aux_int);
+					udphdr->uh_sum = sum ? sum : 0xffff;
+				}
+				iphdr->ip_dst = tmp->ip_int;
+				udphdr->uh_dport = tmp->aux_int;
+
+				free(tmp);
 				break;
 		}
 	}
 	/*print_hdrs(packet, len);*/
+	if (is_first_frag) {
+		sr_forwardNATfirstfragment(sr, &first_frag, packet, len, interface);
+		return;
+	}
 	sr_handleIPforwarding(sr, packet, len, interface);
 	return;
 }
 
+/*
+ * Lower the MSS option of a TCP SYN leaving out of out_if to the
+ * interface's clamp, and to what fits its MTU, if it asks for more. The
+ * checksum is patched for the one or two 16 bit words the value spans.
+ */
+void
+sr_clampTCPMSS(sr_tcp_hdr_t *tcphdr, unsigned int tcp_len,
+	       struct sr_if *out_if)
+{
+	if (!(tcphdr->th_flags & TH_SYN) || out_if->mss == 0) {
+		return;
+	}
+	uint16_t limit = out_if->mtu - sizeof(sr_ip_hdr_t) - 20;
+	if (out_if->mss < limit) {
+		limit = out_if->mss;
+	}
+
+	uint8_t *opt = (uint8_t *) tcphdr;
+	unsigned int hdr_len = (opt[12] >> 4) * 4;
+	if (hdr_len > tcp_len) {
+		return;
+	}
+	unsigned int i = 20;
+	while (i < hdr_len && opt[i] != 0) {
+		if (opt[i] == 1) {
+			/* No-op padding */
+			i++;
+			continue;
+		}
+		if (i + 1 >= hdr_len || opt[i+1] < 2 || i + opt[i+1] > hdr_len) {
+			return;
+		}
+		if (opt[i] == 2 && opt[i+1] == 4) {
+			break;
+		}
+		i += opt[i+1];
+	}
+	if (i >= hdr_len || opt[i] != 2 || ((opt[i+2] << 8) | opt[i+3]) <= limit) {
+		return;
+	}
+
+	unsigned int start = (i + 2) & ~1u;
+	unsigned int end = (i + 5) & ~1u;
+	uint16_t old_words[2], new_word;
+	memcpy(old_words, opt + start, end - start);
+	opt[i+2] = limit >> 8;
+	opt[i+3] = limit & 0xff;
+	unsigned int w;
+	for (w = start; w < end; w += 2) {
+		memcpy(&new_word, opt + w, 2);
+		tcphdr->th_sum = cksum_update16(tcphdr->th_sum, old_words[(w - start) / 2], new_word);
+	}
+}
+
+/*
+ * A fragment crossing the NAT. With full reassembly it is held until the
+ * datagram is whole, which then goes through translate (the send or
+ * receive path) again. With virtual reassembly, fragments after the first
+ * are rewritten like the first was and forwarded, or held until it comes.
+ * Returns 0 for a first fragment under virtual reassembly, which the
+ * caller translates as usual and hands to sr_forwardNATfirstfragment.
+ */
+int
+sr_handleNATfragment(struct sr_instance* sr,
+			   uint8_t * packet/* lent */,
+			   unsigned int len,
+			   char* interface/* lent */,
+			   sr_nat_translate_fn translate)
+{
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
+
+	if (sr->nat->frags.mode == sr_frag_mode_reassemble) {
+		unsigned int whole_len;
+		uint8_t *whole = sr_nat_frag_reassemble(sr->nat, packet, len, &whole_len);
+		if (whole != NULL) {
+			translate(sr, whole, whole_len, interface);
+			free(whole);
+		}
+		return 1;
+	}
+	if ((ntohs(iphdr->ip_off) & IP_OFFMASK) == 0) {
+		return 0;
+	}
+	if (sr_nat_frag_follow(sr->nat, packet, len) == 1) {
+		sr_handleIPforwarding(sr, packet, len, interface);
+	}
+	return 1;
+}
+
+/*
+ * Forward a translated first fragment, original header orig, followed by
+ * the later fragments that arrived before it.
+ */
+void
+sr_forwardNATfirstfragment(struct sr_instance* sr,
+			   sr_ip_hdr_t *orig,
+			   uint8_t * packet/* lent */,
+			   unsigned int len,
+			   char* interface/* lent */)
+{
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
+	struct sr_frag_piece *pieces, *piece;
+
+	pieces = sr_nat_frag_translated(sr->nat, orig, iphdr->ip_src, iphdr->ip_dst);
+	sr_handleIPforwarding(sr, packet, len, interface);
+	for (piece = pieces; piece; piece = piece->next) {
+		sr_handleIPforwarding(sr, piece->buf, piece->len, interface);
+	}
+	sr_frag_free_pieces(pieces);
+}
+
 uint16_t sr_get_tcp_cksum(uint8_t *packet, unsigned int len){
 	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
 	unsigned ip_plen = len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t);
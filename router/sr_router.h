@@ -16,6 +16,7 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_nat.h"
+#include "sr_utils.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -35,6 +36,28 @@
 struct sr_if;
 struct sr_rt;
 
+/* ----------------------------------------------------------------------------
+ * struct sr_icmp_limit
+ *
+ * Rate limits on ICMP the router generates (RFC 1812 4.3.2.8): a token
+ * bucket per message type, and one per destination in a small table
+ * hashed on the address. Destinations hashing to the same slot share its
+ * bucket, so a collision can only limit them harder, never refill it.
+ *
+ * -------------------------------------------------------------------------- */
+
+#define SR_ICMP_SOURCES 256 /* a power of two */
+
+struct sr_icmp_limit
+{
+    uint32_t type_rate;   /* per second, 0 for no limit; burst the same */
+    uint32_t source_rate;
+    struct sr_token_bucket types[256];
+    struct sr_token_bucket sources[SR_ICMP_SOURCES];
+    unsigned long suppressed[256]; /* by type */
+    pthread_mutex_t lock;
+};
+
 /* ----------------------------------------------------------------------------
  * struct sr_instance
  *
@@ -55,6 +78,7 @@ struct sr_instance
     struct sr_arpcache cache;   /* ARP cache */
 	struct sr_nat* nat;
 	int nat_enable;
+	struct sr_icmp_limit icmp_limit;
     pthread_attr_t attr;
     FILE* logfile;
 };
@@ -64,6 +88,8 @@ int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_send_packetv(struct sr_instance* , uint8_t* , unsigned int ,
+                    uint8_t* , unsigned int , const char*);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
 
@@ -72,12 +98,29 @@ void sr_init(struct sr_instance*);
 void sr_enable_NAT(struct sr_instance* sr, int nat_enable);
 void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
 void sr_handle_arpreq(struct sr_instance* sr, struct sr_arpreq* req);
+void sr_sendARPProbe(struct sr_instance* sr, uint32_t ip,
+		     unsigned char *mac, char* interface);
 void sr_sendICMPMsg(struct sr_instance * sr,
 		    uint8_t icmp_type,
 		    uint8_t icmp_code,
 		    char * interface, 
 		    uint8_t * old_packet,
 		    unsigned int len);
+int sr_icmp_allow(struct sr_instance* sr, uint8_t type, uint32_t dst);
+void sr_icmp_limit_dump(struct sr_instance* sr);
+void sr_sendICMPMsgMTU(struct sr_instance * sr,
+		    uint8_t icmp_type,
+		    uint8_t icmp_code,
+		    uint16_t next_mtu,
+		    char * interface,
+		    uint8_t * old_packet,
+		    unsigned int len);
+int sr_sendIPframe(struct sr_instance* sr, uint8_t * packet,
+		   unsigned int len, struct sr_if* out_if);
+void sr_sched_drain(struct sr_instance* sr, struct sr_if* out_if,
+		    const struct timeval* now);
+void sr_sched_start(struct sr_instance* sr);
+void *sr_sched_timeout(void *sr_ptr);
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
 void sr_set_ether_ip(struct sr_instance* , uint32_t );
@@ -22,6 +22,8 @@
 #include "sr_rt.h"
 #include "sr_router.h"
 
+static void sr_rt_join_group(struct sr_instance* sr, struct sr_rt* entry);
+
 /*---------------------------------------------------------------------
  * Method:
  *
@@ -109,6 +111,10 @@ struct in_addr gw, struct in_addr mask,char* if_name)
         sr->routing_table->gw   = gw;
         sr->routing_table->mask = mask;
         strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        sr->routing_table->out_if = 0;
+        sr->routing_table->adj = -1;
+        sr->routing_table->group = 0;
+        sr->routing_table->down = 0;
 
         return;
     }
@@ -128,9 +134,134 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     rt_walker->gw   = gw;
     rt_walker->mask = mask;
     strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    rt_walker->out_if = 0;
+    rt_walker->adj = -1;
+    rt_walker->group = 0;
+    rt_walker->down = 0;
+
+    sr_rt_join_group(sr, rt_walker);
 
 } /* -- sr_add_entry -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_rt_rebalance(..)
+ *
+ * Give every bucket of the group to a live next hop, moving as few as
+ * possible: a live next hop keeps its buckets up to an even share, the
+ * rest go to whichever live next hop has fewest. Buckets are rewritten
+ * one at a time, so concurrent forwarding always sees a valid next hop.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_rt_rebalance(struct sr_rt_group* group)
+{
+    uint8_t buckets[SR_RT_GROUP_BUCKETS];
+    unsigned int load[SR_RT_GROUP_MAX];
+    unsigned int live = 0, share, i, b;
+
+    for (i = 0; i < group->count; i++) {
+        load[i] = 0;
+        if (!group->hops[i]->down)
+        { live++; }
+    }
+    if (live == 0)
+    { return; }
+    share = (SR_RT_GROUP_BUCKETS + live - 1) / live;
+
+    for (b = 0; b < SR_RT_GROUP_BUCKETS; b++) {
+        i = group->buckets[b];
+        if (!group->hops[i]->down && load[i] < share) {
+            buckets[b] = i;
+            load[i]++;
+        } else {
+            buckets[b] = SR_RT_GROUP_MAX;
+        }
+    }
+    for (b = 0; b < SR_RT_GROUP_BUCKETS; b++) {
+        if (buckets[b] == SR_RT_GROUP_MAX) {
+            unsigned int least = SR_RT_GROUP_MAX;
+            for (i = 0; i < group->count; i++) {
+                if (!group->hops[i]->down &&
+                    (least == SR_RT_GROUP_MAX || load[i] < load[least]))
+                { least = i; }
+            }
+            buckets[b] = least;
+            load[least]++;
+        }
+        group->buckets[b] = buckets[b];
+    }
+} /* -- sr_rt_rebalance -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_join_group(..)
+ *
+ * Make a new entry another next hop of an earlier entry for the same
+ * prefix. The earlier one stays the longest match and owns the group.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_rt_join_group(struct sr_instance* sr, struct sr_rt* entry)
+{
+    struct sr_rt* first = sr->routing_table;
+
+    while (first != entry &&
+           (first->dest.s_addr != entry->dest.s_addr ||
+            first->mask.s_addr != entry->mask.s_addr))
+    { first = first->next; }
+    if (first == entry)
+    { return; }
+
+    if (first->group == 0) {
+        first->group = (struct sr_rt_group*)calloc(1, sizeof(struct sr_rt_group));
+        assert(first->group);
+        first->group->hops[0] = first;
+        first->group->count = 1;
+    }
+    if (first->group->count == SR_RT_GROUP_MAX) {
+        fprintf(stderr, "At most %d next hops per prefix, ignoring %s\n",
+                SR_RT_GROUP_MAX, inet_ntoa(entry->gw));
+        return;
+    }
+    entry->group = first->group;
+    first->group->hops[first->group->count++] = entry;
+    sr_rt_rebalance(first->group);
+} /* -- sr_rt_join_group -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_select(..)
+ *
+ * The next hop of a matched entry for a packet with the given flow hash.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt* sr_rt_select(struct sr_rt* entry, uint32_t hash)
+{
+    if (entry->group == 0)
+    { return entry; }
+    return entry->group->hops[entry->group->buckets[hash & (SR_RT_GROUP_BUCKETS - 1)]];
+} /* -- sr_rt_select -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_set_down(..)
+ *
+ * Mark the next hops through gateway gw down or back up, moving their
+ * flows away or back.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rt_set_down(struct sr_instance* sr, uint32_t gw, int down)
+{
+    struct sr_rt* rt_walker;
+
+    for (rt_walker = sr->routing_table; rt_walker; rt_walker = rt_walker->next) {
+        if (rt_walker->group && rt_walker->gw.s_addr == gw &&
+            rt_walker->down != down) {
+            rt_walker->down = down;
+            sr_rt_rebalance(rt_walker->group);
+        }
+    }
+} /* -- sr_rt_set_down -- */
+
 /*---------------------------------------------------------------------
  * Method:
  *
@@ -20,6 +20,29 @@
 
 #include "sr_if.h"
 
+/* ----------------------------------------------------------------------------
+ * struct sr_rt_group
+ *
+ * Equal-cost next hops of one prefix: routing table lines with the same
+ * destination and mask. A packet's flow hash picks a bucket, and the bucket
+ * a next hop. When a next hop goes down only its buckets are handed to
+ * the others, and when it comes back it takes a fair share from each, so
+ * the flows of the other next hops stay where they are.
+ *
+ * -------------------------------------------------------------------------- */
+
+#define SR_RT_GROUP_MAX 8
+#define SR_RT_GROUP_BUCKETS 256 /* a power of two */
+
+struct sr_rt;
+
+struct sr_rt_group
+{
+    unsigned int count;
+    struct sr_rt* hops[SR_RT_GROUP_MAX];
+    uint8_t buckets[SR_RT_GROUP_BUCKETS]; /* index into hops */
+};
+
 /* ----------------------------------------------------------------------------
  * struct sr_rt
  *
@@ -33,14 +56,25 @@ struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    struct sr_if* out_if;   /* resolved outgoing interface, 0 until first use */
+    int    adj;             /* ARP cache slot of the gateway, -1 if unknown */
+    struct sr_rt_group* group; /* next hops of the prefix, 0 if just this */
+    int    down;            /* gateway did not answer ARP */
     struct sr_rt* next;
 };
 
+/* Next-hop IP for a packet to dst routed through entry: the gateway, or the
+   destination itself for directly connected routes (gateway 0.0.0.0). */
+#define sr_rt_nexthop(entry, dst) \
+    ((entry)->gw.s_addr ? (entry)->gw.s_addr : (dst))
+
 
 int sr_load_rt(struct sr_instance*,const char*);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
 void sr_print_routing_table(struct sr_instance* sr);
+struct sr_rt* sr_rt_select(struct sr_rt* entry, uint32_t hash);
+void sr_rt_set_down(struct sr_instance* sr, uint32_t gw, int down);
 void sr_print_routing_entry(struct sr_rt* entry);
 
 
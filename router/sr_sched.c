@@ -0,0 +1,331 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_sched.c
+ *
+ * Description:
+ *
+ * Shaped strict-priority egress queues with FQ-CoDel in each class, see
+ * sr_sched.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sr_sched.h"
+#include "sr_protocol.h"
+#include "sr_stats.h"
+
+static uint64_t sr_sched_usec(const struct timeval *tv)
+{
+    return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+struct sr_sched *sr_sched_create(uint32_t rate, uint32_t burst,
+                                 unsigned int limit)
+{
+    struct sr_sched *sched = (struct sr_sched *) calloc(1, sizeof(struct sr_sched));
+    struct timeval now;
+
+    if (sched == NULL) {
+        return NULL;
+    }
+    gettimeofday(&now, NULL);
+    sr_tb_init(&sched->tb, rate, burst, &now);
+    sched->limit = limit;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_mutex_init(&sched->drain, NULL);
+    return sched;
+}
+
+void sr_sched_destroy(struct sr_sched *sched)
+{
+    int c, f;
+    struct sr_sched_pkt *pkt, *next;
+
+    if (sched == NULL) {
+        return;
+    }
+    for (c = 0; c < SR_SCHED_CLASSES; c++) {
+        for (f = 0; f < SR_SCHED_FLOWS; f++) {
+            for (pkt = sched->classes[c].flows[f].head; pkt; pkt = next) {
+                next = pkt->next;
+                sr_sched_pkt_free(pkt);
+            }
+        }
+    }
+    pthread_mutex_destroy(&sched->lock);
+    pthread_mutex_destroy(&sched->drain);
+    free(sched);
+}
+
+int sr_sched_class(const uint8_t *packet)
+{
+    const sr_ip_hdr_t *iphdr =
+        (const sr_ip_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t));
+    uint8_t dscp = iphdr->ip_tos >> 2;
+
+    if (dscp == 46 || dscp >= 48) {
+        return 0;
+    }
+    if (dscp >= 24) {
+        return 1;
+    }
+    if (dscp == 8 || dscp == 1) {
+        return 3;
+    }
+    return 2;
+}
+
+/* Take the head packet off a flow */
+static struct sr_sched_pkt *sr_sched_pop(struct sr_sched_queue *queue,
+                                         struct sr_sched_flow *flow)
+{
+    struct sr_sched_pkt *pkt = flow->head;
+
+    flow->head = pkt->next;
+    if (flow->head == NULL) {
+        flow->tail = NULL;
+    }
+    flow->count--;
+    flow->bytes -= pkt->len;
+    queue->count--;
+    return pkt;
+}
+
+/* Append a flow to the new or old list */
+static void sr_sched_list_add(struct sr_sched_queue *queue,
+                              struct sr_sched_flow *flow,
+                              sr_sched_flow_list list)
+{
+    struct sr_sched_flow **head = list == sr_sched_flow_new ?
+                                  &queue->new_head : &queue->old_head;
+    struct sr_sched_flow **tail = list == sr_sched_flow_new ?
+                                  &queue->new_tail : &queue->old_tail;
+
+    flow->next = NULL;
+    flow->list = list;
+    if (*tail) {
+        (*tail)->next = flow;
+    } else {
+        *head = flow;
+    }
+    *tail = flow;
+}
+
+/* Remove the flow at the head of its list */
+static void sr_sched_list_pop(struct sr_sched_queue *queue,
+                              struct sr_sched_flow *flow)
+{
+    if (flow->list == sr_sched_flow_new) {
+        queue->new_head = flow->next;
+        if (queue->new_head == NULL) {
+            queue->new_tail = NULL;
+        }
+    } else {
+        queue->old_head = flow->next;
+        if (queue->old_head == NULL) {
+            queue->old_tail = NULL;
+        }
+    }
+    flow->next = NULL;
+    flow->list = sr_sched_flow_idle;
+}
+
+int sr_sched_enqueue(struct sr_sched *sched, const uint8_t *packet,
+                     unsigned int len, uint32_t hash,
+                     const struct timeval *now)
+{
+    struct sr_sched_queue *queue = &sched->classes[sr_sched_class(packet)];
+    struct sr_sched_flow *flow = &queue->flows[hash & (SR_SCHED_FLOWS - 1)];
+    struct sr_sched_flow *fattest;
+    struct sr_sched_pkt *pkt;
+    int f;
+
+    pkt = (struct sr_sched_pkt *) malloc(sizeof(struct sr_sched_pkt) + len);
+    if (pkt == NULL) {
+        return -1;
+    }
+    pkt->next = NULL;
+    pkt->len = len;
+    pkt->enqueued = sr_sched_usec(now);
+    pkt->buf = (uint8_t *) (pkt + 1);
+    memcpy(pkt->buf, packet, len);
+
+    pthread_mutex_lock(&sched->lock);
+    if (queue->count >= sched->limit) {
+        /* Punish the flow causing the backlog, not whoever comes next */
+        fattest = &queue->flows[0];
+        for (f = 1; f < SR_SCHED_FLOWS; f++) {
+            if (queue->flows[f].bytes > fattest->bytes) {
+                fattest = &queue->flows[f];
+            }
+        }
+        sr_sched_pkt_free(sr_sched_pop(queue, fattest));
+        queue->drops++;
+        sr_stats_drop(sr_stats_drop_egress_queue);
+    }
+    if (flow->tail) {
+        flow->tail->next = pkt;
+    } else {
+        flow->head = pkt;
+    }
+    flow->tail = pkt;
+    flow->count++;
+    flow->bytes += len;
+    queue->count++;
+    if (flow->list == sr_sched_flow_idle) {
+        flow->deficit = SR_SCHED_QUANTUM;
+        sr_sched_list_add(queue, flow, sr_sched_flow_new);
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return 0;
+}
+
+/* The flow whose turn it is, by deficit round robin. Empty flows leave
+   the lists here; an empty new flow goes to the old list first, so a flow
+   can't stay new by sending one packet at a time. */
+static struct sr_sched_flow *sr_sched_next_flow(struct sr_sched_queue *queue)
+{
+    struct sr_sched_flow *flow;
+
+    while (1) {
+        flow = queue->new_head ? queue->new_head : queue->old_head;
+        if (flow == NULL) {
+            return NULL;
+        }
+        if (flow->deficit <= 0) {
+            flow->deficit += SR_SCHED_QUANTUM;
+            sr_sched_list_pop(queue, flow);
+            sr_sched_list_add(queue, flow, sr_sched_flow_old);
+            continue;
+        }
+        if (flow->head == NULL) {
+            if (flow->list == sr_sched_flow_new && queue->old_head) {
+                sr_sched_list_pop(queue, flow);
+                sr_sched_list_add(queue, flow, sr_sched_flow_old);
+            } else {
+                sr_sched_list_pop(queue, flow);
+            }
+            continue;
+        }
+        return flow;
+    }
+}
+
+static uint64_t sr_codel_control_law(uint64_t t, unsigned int count)
+{
+    return t + (uint64_t) (SR_CODEL_INTERVAL_US / sqrt(count));
+}
+
+/* Whether the head of the flow has been above target for an interval */
+static int sr_codel_ok_to_drop(struct sr_sched_flow *flow, uint64_t now)
+{
+    if (flow->head == NULL || now - flow->head->enqueued < SR_CODEL_TARGET_US ||
+        flow->bytes <= SR_SCHED_QUANTUM) {
+        flow->first_above = 0;
+        return 0;
+    }
+    if (flow->first_above == 0) {
+        flow->first_above = now + SR_CODEL_INTERVAL_US;
+        return 0;
+    }
+    return now >= flow->first_above;
+}
+
+/* Drop from the head of the flow as CoDel decides, and return the packet
+   left at its head, or NULL if none is. The head stays queued, as it may
+   yet have to wait for tokens. */
+static struct sr_sched_pkt *sr_codel_head(struct sr_sched_queue *queue,
+                                          struct sr_sched_flow *flow,
+                                          uint64_t now)
+{
+    int ok = sr_codel_ok_to_drop(flow, now);
+    unsigned int delta;
+
+    if (flow->dropping) {
+        if (!ok) {
+            flow->dropping = 0;
+        }
+        while (flow->dropping && now >= flow->drop_next) {
+            sr_sched_pkt_free(sr_sched_pop(queue, flow));
+            queue->codel_drops++;
+            sr_stats_drop(sr_stats_drop_codel);
+            flow->drop_count++;
+            if (!sr_codel_ok_to_drop(flow, now)) {
+                flow->dropping = 0;
+            } else {
+                flow->drop_next = sr_codel_control_law(flow->drop_next,
+                                                       flow->drop_count);
+            }
+        }
+    } else if (ok) {
+        sr_sched_pkt_free(sr_sched_pop(queue, flow));
+        queue->codel_drops++;
+        sr_stats_drop(sr_stats_drop_codel);
+        flow->dropping = 1;
+        /* Resume near the last drop rate if dropping stopped only lately */
+        delta = flow->drop_count - flow->last_count;
+        if (delta > 1 && now - flow->drop_next < 16 * SR_CODEL_INTERVAL_US) {
+            flow->drop_count = delta;
+        } else {
+            flow->drop_count = 1;
+        }
+        flow->drop_next = sr_codel_control_law(now, flow->drop_count);
+        flow->last_count = flow->drop_count;
+    }
+    return flow->head;
+}
+
+struct sr_sched_pkt *sr_sched_dequeue(struct sr_sched *sched,
+                                      const struct timeval *now)
+{
+    uint64_t usec = sr_sched_usec(now);
+    struct sr_sched_queue *queue;
+    struct sr_sched_flow *flow;
+    struct sr_sched_pkt *pkt = NULL;
+    uint32_t cost;
+    int c;
+
+    pthread_mutex_lock(&sched->lock);
+    for (c = 0; c < SR_SCHED_CLASSES && pkt == NULL; c++) {
+        queue = &sched->classes[c];
+        while ((flow = sr_sched_next_flow(queue)) != NULL) {
+            if (sr_codel_head(queue, flow, usec) == NULL) {
+                continue;
+            }
+            cost = flow->head->len < sched->tb.burst ? flow->head->len
+                                                     : sched->tb.burst;
+            /* Strict priority: a lower class never passes a held-back head */
+            if (!sr_tb_take(&sched->tb, cost, now)) {
+                pthread_mutex_unlock(&sched->lock);
+                return NULL;
+            }
+            pkt = sr_sched_pop(queue, flow);
+            flow->deficit -= pkt->len;
+            queue->sent++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return pkt;
+}
+
+void sr_sched_pkt_free(struct sr_sched_pkt *pkt)
+{
+    free(pkt);
+}
+
+void sr_sched_dump(struct sr_sched *sched, const char *name)
+{
+    int c;
+
+    fprintf(stderr, "Egress %s:", name);
+    for (c = 0; c < SR_SCHED_CLASSES; c++) {
+        fprintf(stderr, " class %d sent %lu dropped %lu+%lu queued %u;", c,
+                sched->classes[c].sent, sched->classes[c].drops,
+                sched->classes[c].codel_drops, sched->classes[c].count);
+    }
+    fprintf(stderr, "\n");
+}
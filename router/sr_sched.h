@@ -0,0 +1,125 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_sched.h
+ *
+ * Description:
+ *
+ * Egress scheduler of an interface: packets are sorted by DSCP into a few
+ * strict-priority classes and sent no faster than a token bucket allows,
+ * so bulk transfers queue behind latency-sensitive traffic instead of in
+ * front of it. Packets the bucket holds back are sent by a timer thread.
+ *
+ * Within a class packets are queued per flow, hashed on the 5-tuple, and
+ * the flows take turns by deficit round robin, new flows first, so a bulk
+ * transfer can't hold a short interactive flow up behind its backlog. Each
+ * flow runs CoDel (RFC 8289): once its packets have waited longer than
+ * the target for a whole interval, it drops from the head at a rate rising
+ * with the square root of the drops, until the delay falls again. This is
+ * FQ-CoDel (RFC 8290) under a priority scheduler. CoDel decides as packets
+ * are dequeued, and the timer thread dequeues every tick, so a standing
+ * queue is worked down even when no new packets arrive.
+ *
+ * An interface without a scheduler sends straight away; the only cost is
+ * checking for one.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_SCHED_H
+#define SR_SCHED_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "sr_utils.h"
+
+/* Classes, highest priority first:
+   0: EF and network control (DSCP 46, 48 and up)
+   1: CS3 to CS5 and AF3x/AF4x (DSCP 24 to 45)
+   2: everything else
+   3: scavenger, CS1 and LE (DSCP 8 and 1) */
+#define SR_SCHED_CLASSES 4
+
+#define SR_SCHED_LIMIT 256     /* packets queued per class */
+#define SR_SCHED_TICK_US 1000  /* timer period, see sr_sched_start */
+
+#define SR_SCHED_FLOWS 64      /* flow queues per class, a power of two */
+#define SR_SCHED_QUANTUM 1514  /* bytes a flow sends per round */
+
+#define SR_CODEL_TARGET_US 5000     /* acceptable standing queue delay */
+#define SR_CODEL_INTERVAL_US 100000 /* about a worst case round trip */
+
+/* A queued ethernet frame, copied in behind the header */
+struct sr_sched_pkt {
+  struct sr_sched_pkt *next;
+  unsigned int len;
+  uint64_t enqueued; /* microseconds */
+  uint8_t *buf;
+};
+
+typedef enum {
+  sr_sched_flow_idle,
+  sr_sched_flow_new,
+  sr_sched_flow_old
+} sr_sched_flow_list;
+
+struct sr_sched_flow {
+  struct sr_sched_pkt *head;
+  struct sr_sched_pkt *tail;
+  unsigned int count;
+  unsigned int bytes;
+  int deficit;
+  sr_sched_flow_list list;
+  struct sr_sched_flow *next; /* in its list */
+  /* CoDel */
+  uint64_t first_above; /* when the delay may start dropping, 0 if below */
+  uint64_t drop_next;
+  unsigned int drop_count;
+  unsigned int last_count;
+  int dropping;
+};
+
+struct sr_sched_queue {
+  struct sr_sched_flow flows[SR_SCHED_FLOWS];
+  struct sr_sched_flow *new_head, *new_tail;
+  struct sr_sched_flow *old_head, *old_tail;
+  unsigned int count;
+  unsigned long sent;
+  unsigned long drops;       /* over the limit */
+  unsigned long codel_drops; /* queued too long */
+};
+
+struct sr_sched {
+  struct sr_token_bucket tb; /* bytes */
+  unsigned int limit;
+  struct sr_sched_queue classes[SR_SCHED_CLASSES];
+  pthread_mutex_t lock;
+  pthread_mutex_t drain; /* held while sending, so a flow leaves in order */
+};
+
+/* rate (bytes a second) and burst in bytes. A frame longer than the
+   burst is charged the burst. */
+struct sr_sched *sr_sched_create(uint32_t rate, uint32_t burst,
+                                 unsigned int limit);
+void  sr_sched_destroy(struct sr_sched *sched);
+
+/* The class of an IP packet in an ethernet frame */
+int   sr_sched_class(const uint8_t *packet);
+
+/* Queue a copy of the frame in the flow queue hash picks. A full class
+   makes room by dropping from the head of its longest flow. Returns -1 if
+   the frame can't be queued. */
+int   sr_sched_enqueue(struct sr_sched *sched, const uint8_t *packet,
+                       unsigned int len, uint32_t hash,
+                       const struct timeval *now);
+
+/* The next frame to send now: from the highest non-empty class, the next
+   flow's head that CoDel keeps, if the bucket holds its length. NULL if
+   there is none. Free it with sr_sched_pkt_free once sent. */
+struct sr_sched_pkt *sr_sched_dequeue(struct sr_sched *sched,
+                                      const struct timeval *now);
+
+void  sr_sched_pkt_free(struct sr_sched_pkt *pkt);
+
+void  sr_sched_dump(struct sr_sched *sched, const char *name);
+
+#endif /* -- SR_SCHED_H -- */
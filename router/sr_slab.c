@@ -0,0 +1,122 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slab.c
+ *
+ * Description:
+ *
+ * Fixed-size object pools, see sr_slab.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "sr_slab.h"
+
+/* Round x up to a multiple of a, a power of two */
+#define SR_SLAB_ALIGN(x, a) (((x) + (a) - 1) & ~((size_t) (a) - 1))
+
+/* Number of objects in each chunk added once the preallocation runs out */
+#define SR_SLAB_GROW 256
+
+/* Allocate one chunk of count objects and thread them onto the free list. */
+static int sr_slab_grow(struct sr_slab *slab, unsigned int count)
+{
+    /* Over-allocate so the first object can be moved up to the alignment */
+    size_t hdr = sizeof(struct sr_slab_chunk);
+    struct sr_slab_chunk *chunk = (struct sr_slab_chunk *)
+        malloc(hdr + slab->align - 1 + slab->obj_size * count);
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+
+    unsigned int i;
+    char *obj = (char *) SR_SLAB_ALIGN((size_t) ((char *) chunk + hdr),
+                                       slab->align);
+    for (i = 0; i < count; i++, obj += slab->obj_size) {
+        *(void **) obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    slab->total += count;
+    return 0;
+}
+
+int sr_slab_init(struct sr_slab *slab, const char *name, size_t obj_size,
+                 size_t align, unsigned int prealloc)
+{
+    assert(slab);
+    assert(obj_size >= sizeof(void *));
+    assert((align & (align - 1)) == 0);
+
+    if (align < sizeof(void *)) {
+        align = sizeof(void *);
+    }
+    slab->name = name;
+    slab->align = align;
+    slab->obj_size = SR_SLAB_ALIGN(obj_size, align);
+    slab->free_list = NULL;
+    slab->chunks = NULL;
+    slab->total = 0;
+    slab->in_use = 0;
+    slab->high_water = 0;
+
+    if (prealloc) {
+        return sr_slab_grow(slab, prealloc);
+    }
+    return 0;
+}
+
+void *sr_slab_alloc(struct sr_slab *slab)
+{
+    if (slab->free_list == NULL) {
+        /* Steady state never gets here: only when all objects are in use */
+        if (sr_slab_grow(slab, SR_SLAB_GROW)) {
+            return NULL;
+        }
+    }
+
+    void *obj = slab->free_list;
+    slab->free_list = *(void **) obj;
+
+    slab->in_use++;
+    if (slab->in_use > slab->high_water) {
+        slab->high_water = slab->in_use;
+    }
+    return obj;
+}
+
+void sr_slab_free(struct sr_slab *slab, void *obj)
+{
+    if (obj == NULL) {
+        return;
+    }
+    assert(slab->in_use > 0);
+
+    *(void **) obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+}
+
+void sr_slab_destroy(struct sr_slab *slab)
+{
+    struct sr_slab_chunk *chunk = slab->chunks;
+    struct sr_slab_chunk *next;
+    while (chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    slab->chunks = NULL;
+    slab->free_list = NULL;
+    slab->total = 0;
+    slab->in_use = 0;
+}
+
+void sr_slab_dump(struct sr_slab *slab)
+{
+    fprintf(stderr, "%s pool: %u in use, %u high water, %u allocated\n",
+            slab->name, slab->in_use, slab->high_water, slab->total);
+}
@@ -0,0 +1,57 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slab.h
+ *
+ * Description:
+ *
+ * Fixed-size object pools. A pool hands out objects of one size from
+ * large preallocated chunks ("slabs") through a free list, so allocation
+ * and release are O(1) and never touch malloc/free once the pool has
+ * grown to its working size. The pool only asks malloc for another chunk
+ * when every object is in use.
+ *
+ * Pools do no locking of their own; callers serialize access (the NAT
+ * allocates and frees only while holding nat->lock).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_SLAB_H
+#define SR_SLAB_H
+
+#include <stddef.h>
+
+struct sr_slab_chunk {
+    struct sr_slab_chunk *next;
+};
+
+struct sr_slab {
+    const char *name;           /* For sr_slab_dump */
+    size_t obj_size;            /* Size of one object, rounded for alignment */
+    size_t align;               /* Alignment of every object */
+    void *free_list;            /* Singly linked through the objects */
+    struct sr_slab_chunk *chunks;
+    unsigned int total;         /* Objects allocated from malloc */
+    unsigned int in_use;        /* Objects currently handed out */
+    unsigned int high_water;    /* Largest in_use ever seen */
+};
+
+/* Sets up a pool of objects of obj_size bytes and preallocates prealloc of
+   them. Objects start on an align byte boundary (a power of two, 0 for
+   pointer alignment); pass the cache line size to keep each object of at
+   most that size within one line. Returns 0 on success. */
+int   sr_slab_init(struct sr_slab *slab, const char *name, size_t obj_size,
+                   size_t align, unsigned int prealloc);
+
+/* Returns an uninitialized object, or NULL if the pool could not grow. */
+void *sr_slab_alloc(struct sr_slab *slab);
+
+/* Returns obj to the pool. obj must have come from sr_slab_alloc on the
+   same pool. NULL is ignored. */
+void  sr_slab_free(struct sr_slab *slab, void *obj);
+
+/* Releases every chunk. Objects handed out become invalid. */
+void  sr_slab_destroy(struct sr_slab *slab);
+
+/* Prints in-use/high-water/total counts. */
+void  sr_slab_dump(struct sr_slab *slab);
+
+#endif /* -- SR_SLAB_H -- */
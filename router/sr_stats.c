@@ -0,0 +1,223 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_stats.c
+ *
+ * Description:
+ *
+ * Per-thread packet path statistics, see sr_stats.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "sr_stats.h"
+#include "sr_router.h"
+#include "sr_if.h"
+
+static struct sr_stats sr_stats_blocks[SR_STATS_THREADS];
+static unsigned int sr_stats_used;
+static pthread_mutex_t sr_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t sr_stats_key;
+static pthread_once_t sr_stats_once = PTHREAD_ONCE_INIT;
+static volatile sig_atomic_t sr_stats_requested;
+
+static const char *sr_stats_drop_names[sr_stats_drop_count] = {
+    "malformed", "bad checksum", "ttl expired", "no route", "filtered",
+    "needs fragmenting", "unreachable", "arp queue full",
+    "egress queue full", "egress queue delay", "nat", "icmp rate limit"
+};
+
+static const char *sr_stats_counter_names[sr_stats_counter_count] = {
+    "nat hits", "nat misses", "nat inserts", "nat expiries",
+    "arp hits", "arp misses", "arp queued", "route lookups"
+};
+
+static const char *sr_stats_stage_names[sr_stats_stage_count] = {
+    "packet", "forward", "nat out", "nat in", "send"
+};
+
+static void sr_stats_key_init(void)
+{
+    pthread_key_create(&sr_stats_key, NULL);
+}
+
+struct sr_stats *sr_stats_self(void)
+{
+    struct sr_stats *stats;
+
+    pthread_once(&sr_stats_once, sr_stats_key_init);
+    stats = (struct sr_stats *) pthread_getspecific(sr_stats_key);
+    if (stats == NULL) {
+        /* First count on this thread: claim a block */
+        pthread_mutex_lock(&sr_stats_lock);
+        if (sr_stats_used < SR_STATS_THREADS) {
+            sr_stats_used++;
+        }
+        stats = &sr_stats_blocks[sr_stats_used - 1];
+        pthread_mutex_unlock(&sr_stats_lock);
+        pthread_setspecific(sr_stats_key, stats);
+    }
+    return stats;
+}
+
+void sr_stats_rx(int if_index, unsigned int len)
+{
+    struct sr_stats *stats;
+
+    if (if_index >= 0 && if_index < SR_STATS_IFS) {
+        stats = sr_stats_self();
+        stats->rx_packets[if_index]++;
+        stats->rx_bytes[if_index] += len;
+    }
+}
+
+void sr_stats_tx(int if_index, unsigned int len)
+{
+    struct sr_stats *stats;
+
+    if (if_index >= 0 && if_index < SR_STATS_IFS) {
+        stats = sr_stats_self();
+        stats->tx_packets[if_index]++;
+        stats->tx_bytes[if_index] += len;
+    }
+}
+
+void sr_stats_drop(sr_stats_drop_reason reason)
+{
+    sr_stats_self()->drops[reason]++;
+}
+
+void sr_stats_count(sr_stats_counter counter)
+{
+    sr_stats_self()->counters[counter]++;
+}
+
+void sr_stats_icmp(uint8_t type)
+{
+    sr_stats_self()->icmp[type]++;
+}
+
+uint64_t sr_stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sr_stats_latency(sr_stats_stage stage, uint64_t start)
+{
+    uint64_t ns = sr_stats_clock() - start;
+    int bucket = 0;
+
+    /* floor(log2(ns)), 0 for 0 and 1 */
+    while (ns > 1 && bucket < SR_STATS_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    sr_stats_self()->latency[stage][bucket]++;
+}
+
+void sr_stats_sum(struct sr_stats *total)
+{
+    unsigned long *sum = (unsigned long *) total;
+    const unsigned long *block;
+    unsigned int i, t, used;
+
+    memset(total, 0, sizeof(struct sr_stats));
+    pthread_mutex_lock(&sr_stats_lock);
+    used = sr_stats_used;
+    pthread_mutex_unlock(&sr_stats_lock);
+    for (t = 0; t < used; t++) {
+        block = (const unsigned long *) &sr_stats_blocks[t];
+        for (i = 0; i < sizeof(struct sr_stats) / sizeof(unsigned long); i++) {
+            sum[i] += block[i];
+        }
+    }
+}
+
+void sr_stats_request(int sig)
+{
+    sr_stats_requested = 1;
+}
+
+void sr_stats_poll(struct sr_instance *sr)
+{
+    if (sr_stats_requested) {
+        sr_stats_requested = 0;
+        sr_stats_dump(sr);
+    }
+}
+
+/* Upper bound of the bucket the given fraction of samples falls in */
+static unsigned long long sr_stats_percentile(const unsigned long *buckets,
+                                              unsigned long samples,
+                                              double fraction)
+{
+    unsigned long seen = 0;
+    int b;
+
+    for (b = 0; b < SR_STATS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= samples * fraction) {
+            break;
+        }
+    }
+    return 2ULL << (b < SR_STATS_BUCKETS ? b : SR_STATS_BUCKETS - 1);
+}
+
+void sr_stats_dump(struct sr_instance *sr)
+{
+    static struct sr_stats total;
+    struct sr_if *iface;
+    unsigned long samples;
+    int i, b;
+
+    sr_stats_sum(&total);
+    fprintf(stderr, "Statistics:\n");
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        if (iface->index < SR_STATS_IFS) {
+            i = iface->index;
+            fprintf(stderr, "  %s: rx %lu packets %lu bytes, tx %lu packets %lu bytes\n",
+                    iface->name, total.rx_packets[i], total.rx_bytes[i],
+                    total.tx_packets[i], total.tx_bytes[i]);
+        }
+    }
+    for (i = 0; i < sr_stats_drop_count; i++) {
+        if (total.drops[i]) {
+            fprintf(stderr, "  dropped, %s: %lu\n", sr_stats_drop_names[i],
+                    total.drops[i]);
+        }
+    }
+    for (i = 0; i < sr_stats_counter_count; i++) {
+        fprintf(stderr, "  %s: %lu\n", sr_stats_counter_names[i],
+                total.counters[i]);
+    }
+    for (i = 0; i < 256; i++) {
+        if (total.icmp[i]) {
+            fprintf(stderr, "  icmp type %d sent: %lu\n", i, total.icmp[i]);
+        }
+    }
+    for (i = 0; i < sr_stats_stage_count; i++) {
+        samples = 0;
+        for (b = 0; b < SR_STATS_BUCKETS; b++) {
+            samples += total.latency[i][b];
+        }
+        if (samples == 0) {
+            continue;
+        }
+        fprintf(stderr, "  %s latency: %lu samples, p50 < %lluns, p99 < %lluns\n",
+                sr_stats_stage_names[i], samples,
+                sr_stats_percentile(total.latency[i], samples, 0.5),
+                sr_stats_percentile(total.latency[i], samples, 0.99));
+        for (b = 0; b < SR_STATS_BUCKETS; b++) {
+            if (total.latency[i][b]) {
+                fprintf(stderr, "    < %lluns: %lu\n", 2ULL << b,
+                        total.latency[i][b]);
+            }
+        }
+    }
+}
@@ -0,0 +1,102 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_stats.h
+ *
+ * Description:
+ *
+ * Counters and latency histograms along the packet path. Each thread
+ * counts into a block of its own, aligned to cache lines so threads never
+ * share one, with plain increments: no locks or atomics on the hot path.
+ * The blocks are summed when the statistics are asked for, which may read
+ * a counter mid-update and be off by the packet in flight.
+ *
+ * Latencies are kept in buckets by powers of two of nanoseconds.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_STATS_H
+#define SR_STATS_H
+
+#include <stdint.h>
+
+struct sr_instance;
+
+#define SR_STATS_LINE 64     /* cache line size */
+#define SR_STATS_THREADS 8   /* blocks; threads beyond share the last */
+#define SR_STATS_IFS 8       /* interfaces counted, by position */
+#define SR_STATS_BUCKETS 32  /* latency buckets, 1ns up to 2^32ns */
+
+typedef enum {
+  sr_stats_drop_malformed,    /* short, oversize or not IPv4 */
+  sr_stats_drop_checksum,
+  sr_stats_drop_ttl,
+  sr_stats_drop_no_route,
+  sr_stats_drop_filtered,     /* by a packet filter */
+  sr_stats_drop_df,           /* too big and may not be fragmented */
+  sr_stats_drop_unreachable,  /* next hop never answered ARP */
+  sr_stats_drop_arp_queue,    /* too many waiting on one ARP request */
+  sr_stats_drop_egress_queue, /* shaper class full */
+  sr_stats_drop_codel,        /* queued too long in the shaper */
+  sr_stats_drop_nat,          /* no mapping, or filtered by the NAT */
+  sr_stats_drop_icmp_limit,   /* ICMP the rate limit suppressed */
+  sr_stats_drop_count
+} sr_stats_drop_reason;
+
+typedef enum {
+  sr_stats_nat_hit,
+  sr_stats_nat_miss,
+  sr_stats_nat_insert,
+  sr_stats_nat_expire,
+  sr_stats_arp_hit,
+  sr_stats_arp_miss,
+  sr_stats_arp_queued,
+  sr_stats_lpm_lookup,
+  sr_stats_counter_count
+} sr_stats_counter;
+
+typedef enum {
+  sr_stats_stage_packet,  /* a received frame, end to end */
+  sr_stats_stage_forward, /* routing and sending a transit packet */
+  sr_stats_stage_nat_out, /* translating from the inside */
+  sr_stats_stage_nat_in,  /* translating from the outside */
+  sr_stats_stage_send,    /* writing a frame to the server */
+  sr_stats_stage_count
+} sr_stats_stage;
+
+/* One thread's counts. Only unsigned longs, so blocks can be summed word
+   by word. */
+struct sr_stats {
+  unsigned long rx_packets[SR_STATS_IFS];
+  unsigned long rx_bytes[SR_STATS_IFS];
+  unsigned long tx_packets[SR_STATS_IFS];
+  unsigned long tx_bytes[SR_STATS_IFS];
+  unsigned long drops[sr_stats_drop_count];
+  unsigned long counters[sr_stats_counter_count];
+  unsigned long icmp[256]; /* generated, by type */
+  unsigned long latency[sr_stats_stage_count][SR_STATS_BUCKETS];
+} __attribute__ ((aligned (SR_STATS_LINE)));
+
+/* The calling thread's block */
+struct sr_stats *sr_stats_self(void);
+
+void  sr_stats_rx(int if_index, unsigned int len);
+void  sr_stats_tx(int if_index, unsigned int len);
+void  sr_stats_drop(sr_stats_drop_reason reason);
+void  sr_stats_count(sr_stats_counter counter);
+void  sr_stats_icmp(uint8_t type);
+
+/* Nanoseconds on a monotonic clock, to time a stage from */
+uint64_t sr_stats_clock(void);
+/* Record a stage that began at start */
+void  sr_stats_latency(sr_stats_stage stage, uint64_t start);
+
+/* Sum of all threads' blocks */
+void  sr_stats_sum(struct sr_stats *total);
+
+/* Ask for a dump from a signal handler; sr_stats_poll prints it later
+   on a thread where printing is safe. */
+void  sr_stats_request(int sig);
+void  sr_stats_poll(struct sr_instance *sr);
+
+void  sr_stats_dump(struct sr_instance *sr);
+
+#endif /* -- SR_STATS_H -- */
@@ -20,6 +20,62 @@ uint16_t cksum (const void *_data, int len) {
 }
 
 
+/* Incrementally update a checksum for a 16 bit field changing from old_val
+   to new_val (RFC 1624). Values are taken as stored in the packet. */
+uint16_t cksum_update16(uint16_t sum, uint16_t old_val, uint16_t new_val) {
+  uint32_t s = (uint16_t) ~sum + (uint16_t) ~old_val + new_val;
+  s = (s >> 16) + (s & 0xffff);
+  s += s >> 16;
+  return (uint16_t) ~s;
+}
+
+/* Same as cksum_update16, for a 32 bit field such as an IP address. */
+uint16_t cksum_update32(uint16_t sum, uint32_t old_val, uint32_t new_val) {
+  sum = cksum_update16(sum, (uint16_t) (old_val >> 16), (uint16_t) (new_val >> 16));
+  return cksum_update16(sum, (uint16_t) old_val, (uint16_t) new_val);
+}
+
+
+void sr_tb_init(struct sr_token_bucket *tb, uint32_t rate, uint32_t burst,
+                const struct timeval *now) {
+  tb->rate = rate;
+  tb->burst = burst;
+  tb->tokens = (uint64_t) burst * 1000000;
+  tb->last = *now;
+}
+
+static void sr_tb_refill(struct sr_token_bucket *tb, const struct timeval *now) {
+  int64_t us;
+
+  us = (int64_t) (now->tv_sec - tb->last.tv_sec) * 1000000 +
+       (now->tv_usec - tb->last.tv_usec);
+  if (us > 0) {
+    /* Anything past a full bucket is lost anyway; cap to avoid overflow */
+    if (us > 100000000)
+      us = 100000000;
+    tb->tokens += (uint64_t) us * tb->rate;
+    if (tb->tokens > (uint64_t) tb->burst * 1000000)
+      tb->tokens = (uint64_t) tb->burst * 1000000;
+    tb->last = *now;
+  }
+}
+
+int sr_tb_has(struct sr_token_bucket *tb, uint32_t n, const struct timeval *now) {
+  if (tb->rate == 0)
+    return 1;
+  sr_tb_refill(tb, now);
+  return tb->tokens >= (uint64_t) n * 1000000;
+}
+
+int sr_tb_take(struct sr_token_bucket *tb, uint32_t n, const struct timeval *now) {
+  if (!sr_tb_has(tb, n, now))
+    return 0;
+  if (tb->rate == 0)
+    return 1;
+  tb->tokens -= (uint64_t) n * 1000000;
+  return 1;
+}
+
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
   return ntohs(ehdr->ether_type);
@@ -158,6 +214,16 @@ void print_hdr_tcp(uint8_t *buf) {
 	fprintf(stderr, "\tth_urp: %d\n", tcphdr->th_urp);
 }
 
+/* Prints out fields in UDP header */
+void print_hdr_udp(uint8_t *buf) {
+	sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *)(buf);
+	fprintf(stderr, "UDP header:\n");
+	fprintf(stderr, "\tuh_sport: %d\n", ntohs(udphdr->uh_sport));
+	fprintf(stderr, "\tuh_dport: %d\n", ntohs(udphdr->uh_dport));
+	fprintf(stderr, "\tuh_ulen: %d\n", ntohs(udphdr->uh_ulen));
+	fprintf(stderr, "\tuh_sum: %d\n", udphdr->uh_sum);
+}
+
 /* Prints out all possible headers, starting from Ethernet */
 void print_hdrs(uint8_t *buf, uint32_t length) {
 
@@ -187,6 +253,12 @@ void print_hdrs(uint8_t *buf, uint32_t length) {
         fprintf(stderr, "Failed to print ICMP header, insufficient length\n");
       else
         print_hdr_icmp(buf + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+    }else if (ip_proto == ip_protocol_udp) { /* UDP */
+      minlength += sizeof(sr_udp_hdr_t);
+      if (length < minlength)
+        fprintf(stderr, "Failed to print UDP header, insufficient length\n");
+      else
+        print_hdr_udp(buf + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
     }else{
 	     minlength += sizeof(sr_tcp_hdr_t);
 	     print_hdr_tcp(buf + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
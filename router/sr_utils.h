@@ -28,7 +28,29 @@
 #ifndef SR_UTILS_H
 #define SR_UTILS_H
 
+#include <stdint.h>
+#include <sys/time.h>
+
 uint16_t cksum(const void *_data, int len);
+uint16_t cksum_update16(uint16_t sum, uint16_t old_val, uint16_t new_val);
+uint16_t cksum_update32(uint16_t sum, uint32_t old_val, uint32_t new_val);
+
+/* Token bucket: rate tokens a second, holding at most burst. Tokens are
+   kept in millionths so refills from microsecond clocks stay exact. A
+   rate of 0 lets everything through. */
+struct sr_token_bucket {
+  uint32_t rate;
+  uint32_t burst;
+  uint64_t tokens;
+  struct timeval last;
+};
+
+void sr_tb_init(struct sr_token_bucket *tb, uint32_t rate, uint32_t burst,
+                const struct timeval *now);
+/* Whether the bucket holds n tokens, without taking them. */
+int sr_tb_has(struct sr_token_bucket *tb, uint32_t n, const struct timeval *now);
+/* Take n tokens if the bucket holds them; returns 1 if it did. */
+int sr_tb_take(struct sr_token_bucket *tb, uint32_t n, const struct timeval *now);
 
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
@@ -42,6 +64,7 @@ void print_hdr_ip(uint8_t *buf);
 void print_hdr_icmp(uint8_t *buf);
 void print_hdr_arp(uint8_t *buf);
 void print_hdr_tcp(uint8_t *buf);
+void print_hdr_udp(uint8_t *buf);
 
 /* prints all headers, starting from eth */
 void print_hdrs(uint8_t *buf, uint32_t length);
@@ -35,12 +35,14 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
 
+#include "sr_stats.h"
 #include "sha1.h"
 #include "vnscommand.h"
 
@@ -337,6 +339,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
     unsigned char *buf = 0;
     c_packet_ethernet_header* sr_pkt = 0;
     int ret = 0, bytes_read = 0;
+    uint64_t start;
 
     /* REQUIRES */
     assert(sr);
@@ -439,11 +442,13 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                     ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
 
             /* -- pass to router, student's code should take over here -- */
+            start = sr_stats_clock();
             sr_handlepacket(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
                     (char*)(buf + sizeof(c_base)));
+            sr_stats_latency(sr_stats_stage_packet, start);
 
             break;
 
@@ -566,6 +571,7 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
 {
     c_packet_header *sr_pkt;
     unsigned int total_len =  len + (sizeof(c_packet_header));
+    uint64_t start;
 
     /* REQUIRES */
     assert(sr);
@@ -597,17 +603,89 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
         return -1;
     }
 
+    start = sr_stats_clock();
     if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
         fprintf(stderr, "Error writing packet\n");
         free(sr_pkt);
         return -1;
     }
+    sr_stats_latency(sr_stats_stage_send, start);
+    sr_stats_tx(sr_get_interface(sr, iface)->index, len);
 
     free(sr_pkt);
 
     return 0;
 } /* -- sr_send_packet -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packetv(..)
+ * Scope: Global
+ *
+ * Send a packet made of two pieces, hdr (ethernet header included!) and
+ * body, without first copying them together. Used to send fragments
+ * whose payload is a slice of the original datagram.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packetv(struct sr_instance* sr /* borrowed */,
+                         uint8_t* hdr /* borrowed */ ,
+                         unsigned int hdr_len,
+                         uint8_t* body /* borrowed */ ,
+                         unsigned int body_len,
+                         const char* iface /* borrowed */)
+{
+    c_packet_header sr_pkt;
+    struct iovec iov[3];
+    unsigned int len = hdr_len + body_len;
+    unsigned int total_len =  len + (sizeof(c_packet_header));
+    uint64_t start;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(hdr);
+    assert(iface);
+
+    if ( hdr_len < sizeof(struct sr_ethernet_hdr) ){
+        fprintf(stderr , "** Error: packet is wayy to short \n");
+        return -1;
+    }
+
+    sr_pkt.mLen  = htonl(total_len);
+    sr_pkt.mType = htonl(VNSPACKET);
+    strncpy(sr_pkt.mInterfaceName,iface,16);
+
+    /* -- log packet, which wants it in one piece -- */
+    if ( sr->logfile ){
+        uint8_t *flat = (uint8_t *)malloc(len);
+        assert(flat);
+        memcpy(flat, hdr, hdr_len);
+        memcpy(flat + hdr_len, body, body_len);
+        sr_log_packet(sr,flat,len);
+        free(flat);
+    }
+
+    if ( ! sr_ether_addrs_match_interface( sr, hdr, iface) ){
+        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+        return -1;
+    }
+
+    iov[0].iov_base = &sr_pkt;
+    iov[0].iov_len = sizeof(c_packet_header);
+    iov[1].iov_base = hdr;
+    iov[1].iov_len = hdr_len;
+    iov[2].iov_base = body;
+    iov[2].iov_len = body_len;
+    start = sr_stats_clock();
+    if( writev(sr->sockfd, iov, 3) < total_len ){
+        fprintf(stderr, "Error writing packet\n");
+        return -1;
+    }
+    sr_stats_latency(sr_stats_stage_send, start);
+    sr_stats_tx(sr_get_interface(sr, iface)->index, len);
+
+    return 0;
+} /* -- sr_send_packetv -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
  * Scope: Local